@@ -0,0 +1,315 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <limits>
+
+#include <tiny/rigid/rigidbody.h>
+
+using namespace std;
+using namespace tiny;
+
+//Compare the results of the different broad phase structures and their performance on a few scenes.
+
+class BenchmarkSystem : public rigid::RigidBodySystem
+{
+    public:
+        BenchmarkSystem(const std::vector<float> &heights, const int &nrBodies, const float &spacing, const vec3 &a_push) :
+            RigidBodySystem(),
+            push(a_push),
+            terrain(128, 128, heights, vec2(1.0f, 1.0f))
+        {
+            addStaticCollider(&terrain);
+            
+            //Place bodies on a square grid with the given spacing.
+            const int n = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(nrBodies))));
+
+            for (int i = 0; i < nrBodies; ++i)
+            {
+                addSpheresRigidBody(1.0f, {
+                    vec4(0.0f, 0.0f, 0.0f, 0.3f),
+                    vec4(0.3f, 0.0f, 0.0f, 0.3f),
+                    vec4(0.0f, 0.3f, 0.0f, 0.3f)
+                    }, vec3(spacing*(static_cast<float>(i % n) - 0.5f*n), 1.0f + static_cast<float>(i % 3), spacing*(static_cast<float>(i/n) - 0.5f*n)),
+                    vec3(0.0f, 0.0f, 0.0f), normalize(vec4(0.1f*static_cast<float>(i % 7), 0.2f, 0.3f, 1.0f)));
+            }
+        }
+
+        ~BenchmarkSystem()
+        {
+
+        }
+
+    protected:
+        void applyExternalForces()
+        {
+            for (auto &b : bodies)
+            {
+                b.f = (1.0f/b.invM)*vec3(push.x, -9.81f, push.z);
+            }
+        }
+
+    private:
+        vec3 push;
+        rigid::HeightField terrain;
+};
+
+bool haveIdenticalQueries()
+{
+    //Compare box and ray queries of all broad phase structures on random boxes.
+    //Boxes covering 4x4x4 grid cells regularly have several cells sharing a hash bucket, which should not lead to duplicates.
+    aabb::Tree tree;
+    aabb::SortedAxis sortedAxis;
+    aabb::HashGrid hashGrid(1.0f);
+    const std::vector<aabb::BroadPhase *> broadPhases = {&tree, &sortedAxis, &hashGrid};
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> position(0.0f, 40.0f), size(0.1f, 3.9f);
+    const auto getBox = [&]()
+    {
+        const vec3 lb(position(random), position(random), position(random));
+
+        return aabb::aabb{lb, lb + vec3(size(random), size(random), size(random))};
+    };
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        const aabb::aabb box = getBox();
+
+        for (auto b : broadPhases) b->insert(box, i);
+    }
+
+    //Move some boxes around.
+    for (int i = 0; i < 2000; i += 3)
+    {
+        const aabb::aabb box = getBox();
+
+        for (auto b : broadPhases)
+        {
+            b->erase(i);
+            b->insert(box, i);
+        }
+    }
+
+    for (auto b : broadPhases) b->check();
+
+    std::vector<int> reference, contents;
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        //Alternate between boxes and finite or unbounded rays with and without radius.
+        const aabb::aabb box = getBox();
+        const vec3 direction = normalize(box.ub - box.lb - vec3(2.0f));
+        const float maxDistance = (i % 4 == 1 ? 20.0f : std::numeric_limits<float>::max());
+        const float radius = (i % 8 == 3 ? 1.5f : 0.0f);
+
+        for (size_t j = 0; j < broadPhases.size(); ++j)
+        {
+            contents.clear();
+            if (i % 2 == 0) broadPhases[j]->getOverlappingContents(box, contents);
+            else broadPhases[j]->getRayContents(box.lb, direction, maxDistance, radius, contents);
+            std::sort(contents.begin(), contents.end());
+
+            if (std::adjacent_find(contents.begin(), contents.end()) != contents.end())
+            {
+                cerr << "Broad phase " << j << " reported duplicate contents!" << endl;
+                return false;
+            }
+
+            if (j == 0) reference = contents;
+            else if (contents != reference) return false;
+        }
+    }
+
+    return true;
+}
+
+bool haveIdenticalPairs()
+{
+    //Compare the simultaneous traversals of one and two trees with all pairs of overlapping boxes, for trees of various sizes.
+    std::mt19937 random(5678);
+    std::uniform_real_distribution<float> position(0.0f, 20.0f), size(0.1f, 2.0f);
+    const auto getBox = [&]()
+    {
+        const vec3 lb(position(random), position(random), position(random));
+
+        return aabb::aabb{lb, lb + vec3(size(random), size(random), size(random))};
+    };
+
+    for (const int &n : {0, 1, 2, 17, 1000})
+    {
+        aabb::Tree tree1, tree2;
+        std::vector<aabb::aabb> boxes1(n), boxes2(n);
+
+        for (int i = 0; i < n; ++i)
+        {
+            boxes1[i] = getBox();
+            boxes2[i] = getBox();
+            tree1.insert(boxes1[i], i);
+            tree2.insert(boxes2[i], i);
+        }
+
+        //Move some boxes around, such that the trees are not only built by insertion.
+        for (int i = 0; i < n; i += 3)
+        {
+            boxes1[i] = getBox();
+            tree1.erase(i);
+            tree1.insert(boxes1[i], i);
+        }
+
+        std::vector<std::pair<int, int>> reference, pairs;
+
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = i + 1; j < n; ++j)
+            {
+                if (overlapping(boxes1[i], boxes1[j])) reference.push_back({i, j});
+            }
+        }
+
+        tree1.getOverlappingContents(pairs);
+        std::sort(pairs.begin(), pairs.end());
+
+        if (pairs != reference) return false;
+
+        reference.clear();
+        pairs.clear();
+
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                if (overlapping(boxes1[i], boxes2[j])) reference.push_back({i, j});
+            }
+        }
+
+        tree1.getOverlappingContents(tree2, pairs);
+        std::sort(pairs.begin(), pairs.end());
+
+        if (pairs != reference) return false;
+    }
+
+    return true;
+}
+
+struct Scene
+{
+    std::string name;
+    int nrBodies;
+    float spacing;
+    vec3 push;
+};
+
+int main(int, char **)
+{
+    std::vector<float> heights(128*128);
+
+    for (int y = 0; y < 128; ++y)
+    {
+        for (int x = 0; x < 128; ++x)
+        {
+            heights[x + 128*y] = 0.5f*std::sin(0.4f*static_cast<float>(x))*std::sin(0.3f*static_cast<float>(y));
+        }
+    }
+
+    const std::vector<Scene> scenes = {
+        {"pile", 400, 0.8f, vec3(0.0f)},
+        {"arena", 1600, 2.5f, vec3(0.0f)},
+        {"stampede", 1600, 2.5f, vec3(4.0f, 0.0f, 1.0f)}
+    };
+    const std::vector<std::pair<std::string, rigid::RigidBodyBroadPhase>> broadPhases = {
+        {"tree", rigid::RigidBodyBroadPhase::Tree},
+        {"sorted axis", rigid::RigidBodyBroadPhase::SortedAxis},
+        {"hash grid", rigid::RigidBodyBroadPhase::HashGrid}
+    };
+    const int nrFrames = 300;
+    bool identical = true;
+
+    if (!haveIdenticalQueries())
+    {
+        cerr << "Broad phase structures yielded different box queries!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!haveIdenticalPairs())
+    {
+        cerr << "Tree traversal yielded different overlapping pairs!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    for (const auto &scene : scenes)
+    {
+        std::vector<rigid::RigidBody> reference;
+
+        for (const auto &broadPhase : broadPhases)
+        {
+            //Suppress the output of adding bodies.
+            std::streambuf *coutBuffer = cout.rdbuf(nullptr);
+            BenchmarkSystem system(heights, scene.nrBodies, scene.spacing, scene.push);
+            cout.rdbuf(coutBuffer);
+
+            system.setBroadPhase(broadPhase.second, 4.0f);
+            system.setStatistics(true);
+            
+            double broadPhaseTime = 0.0, totalTime = 0.0;
+            int nrPairs = 0;
+
+            for (int i = 0; i < nrFrames; ++i)
+            {
+                system.update(1.0f/60.0f);
+                broadPhaseTime += system.getStatistics().broadPhaseTime;
+                totalTime += system.getStatistics().totalTime;
+                nrPairs += system.getStatistics().nrPairs;
+            }
+
+            cerr << scene.name << " (" << scene.nrBodies << " bodies), " << broadPhase.first << ": broad phase " << broadPhaseTime/nrFrames << "ms, total " << totalTime/nrFrames << "ms, " << nrPairs/nrFrames << " pairs per update" << endl;
+
+            //All broad phase structures should yield identical simulations.
+            rigid::RigidBodySystemSnapshot snapshot;
+
+            system.saveSnapshot(snapshot);
+
+            if (reference.empty())
+            {
+                reference = snapshot.bodies;
+            }
+            else
+            {
+                for (size_t i = 0; i < reference.size(); ++i)
+                {
+                    if (memcmp(&reference[i].x, &snapshot.bodies[i].x, sizeof(vec3)) != 0 ||
+                        memcmp(&reference[i].q, &snapshot.bodies[i].q, sizeof(vec4)) != 0) identical = false;
+                }
+            }
+        }
+    }
+
+    if (!identical)
+    {
+        cerr << "Broad phase structures yielded different simulations!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
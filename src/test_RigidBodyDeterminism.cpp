@@ -0,0 +1,142 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+
+#include <tiny/rigid/rigidbody.h>
+
+using namespace std;
+using namespace tiny;
+
+//Verify that two independent rigid body systems with identical inputs remain bitwise identical.
+
+class PileSystem : public rigid::RigidBodySystem
+{
+    public:
+        PileSystem(const std::vector<float> &heights) :
+            RigidBodySystem(),
+            push(0.0f),
+            terrain(64, 64, heights, vec2(1.0f, 1.0f))
+        {
+            addStaticCollider(&terrain);
+            
+            //Drop a pile of bodies with some constraints between them.
+            for (int i = 0; i < 128; ++i)
+            {
+                const int j = addSpheresRigidBody(1.0f, {
+                    vec4(0.0f, 0.0f, 0.0f, 0.3f),
+                    vec4(0.3f, 0.0f, 0.0f, 0.3f),
+                    vec4(0.0f, 0.3f, 0.0f, 0.3f)
+                    }, vec3(static_cast<float>(i % 8) - 3.5f, 1.0f + static_cast<float>(i/32), static_cast<float>((i/8) % 4) - 1.5f),
+                    vec3(0.0f, 0.0f, 0.0f), normalize(vec4(0.1f*static_cast<float>(i % 7), 0.2f, 0.3f, 1.0f)));
+
+                if (i % 4 != 0)
+                {
+                    addNonCollidingPair(j - 1, j);
+                    addPositionConstraint(j - 1, vec3(0.3f, 0.0f, 0.0f), j, vec3(-0.3f, 0.0f, 0.0f), 0.1f);
+                }
+            }
+        }
+
+        ~PileSystem()
+        {
+
+        }
+
+        float push;
+
+    protected:
+        void applyExternalForces()
+        {
+            for (auto &b : bodies)
+            {
+                b.f = vec3(push, -9.81f/b.invM, 0.0f);
+            }
+        }
+
+    private:
+        rigid::HeightField terrain;
+};
+
+bool isIdentical(const rigid::RigidBodySystem &a, const rigid::RigidBodySystem &b)
+{
+    //Compare complete body states bitwise.
+    rigid::RigidBodySystemSnapshot sa, sb;
+
+    a.saveSnapshot(sa);
+    b.saveSnapshot(sb);
+
+    if (sa.bodies.size() != sb.bodies.size()) return false;
+
+    for (size_t i = 0; i < sa.bodies.size(); ++i)
+    {
+        const rigid::RigidBody &ba = sa.bodies[i];
+        const rigid::RigidBody &bb = sb.bodies[i];
+
+        if (memcmp(&ba.x, &bb.x, sizeof(vec3)) != 0 ||
+            memcmp(&ba.q, &bb.q, sizeof(vec4)) != 0 ||
+            memcmp(&ba.v, &bb.v, sizeof(vec3)) != 0 ||
+            memcmp(&ba.w, &bb.w, sizeof(vec3)) != 0) return false;
+    }
+
+    return true;
+}
+
+int main(int, char **)
+{
+    std::vector<float> heights(64*64);
+
+    for (int y = 0; y < 64; ++y)
+    {
+        for (int x = 0; x < 64; ++x)
+        {
+            heights[x + 64*y] = 0.5f*std::sin(0.4f*static_cast<float>(x))*std::sin(0.3f*static_cast<float>(y));
+        }
+    }
+
+    //Use different numbers of threads, which should not influence the results.
+    PileSystem system1(heights);
+    PileSystem system2(heights);
+
+    system1.setRandomSeed(1234);
+    system2.setRandomSeed(1234);
+    system1.setNrThreads(1);
+    system2.setNrThreads(4);
+    
+    for (int i = 0; i < 600; ++i)
+    {
+        //Identical input for both systems.
+        system1.push = system2.push = (i % 120 < 60 ? 2.0f : -2.0f);
+        system1.update(1.0f/60.0f);
+        system2.update(1.0f/60.0f);
+
+        if (!isIdentical(system1, system2))
+        {
+            cerr << "Rigid body systems diverged at update " << i << "!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    cerr << system1;
+    cerr << "Rigid body systems remained identical." << endl;
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,182 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+
+#include <tiny/rigid/rigidbody.h>
+#include <tiny/rigid/rigidbodygroup.h>
+
+using namespace std;
+using namespace tiny;
+
+//Verify that rigid body systems stepped concurrently by a group match systems stepped serially and stay on their threads.
+
+class DropSystem : public rigid::RigidBodySystem
+{
+    public:
+        DropSystem(const int &nrBodies) :
+            RigidBodySystem(),
+            threadId(),
+            nrThreadChanges(0),
+            terrain(16, 16, std::vector<float>(16*16, 0.0f), vec2(1.0f, 1.0f))
+        {
+            setRandomSeed(1234);
+
+            addStaticCollider(&terrain);
+
+            //Drop a column of bodies onto flat terrain.
+            for (int i = 0; i < nrBodies; ++i)
+            {
+                addSpheresRigidBody(1.0f, {
+                    vec4(0.0f, 0.0f, 0.0f, 0.3f),
+                    vec4(0.3f, 0.0f, 0.0f, 0.3f)
+                    }, vec3(0.1f*static_cast<float>(i % 3), 0.5f + 0.7f*static_cast<float>(i), 0.1f*static_cast<float>(i % 5)));
+            }
+        }
+
+        ~DropSystem()
+        {
+
+        }
+
+        std::thread::id threadId;
+        int nrThreadChanges;
+
+    protected:
+        void applyExternalForces()
+        {
+            //Record the thread updating this system.
+            if (threadId != std::this_thread::get_id())
+            {
+                threadId = std::this_thread::get_id();
+                ++nrThreadChanges;
+            }
+
+            for (auto &b : bodies)
+            {
+                b.f = vec3(0.0f, -9.81f/b.invM, 0.0f);
+            }
+        }
+
+    private:
+        rigid::HeightField terrain;
+};
+
+bool isIdentical(const rigid::RigidBodySystem &a, const rigid::RigidBodySystem &b)
+{
+    //Compare complete body states bitwise.
+    rigid::RigidBodySystemSnapshot sa, sb;
+
+    a.saveSnapshot(sa);
+    b.saveSnapshot(sb);
+
+    if (sa.bodies.size() != sb.bodies.size()) return false;
+
+    for (size_t i = 0; i < sa.bodies.size(); ++i)
+    {
+        const rigid::RigidBody &ba = sa.bodies[i];
+        const rigid::RigidBody &bb = sb.bodies[i];
+
+        if (memcmp(&ba.x, &bb.x, sizeof(vec3)) != 0 ||
+            memcmp(&ba.q, &bb.q, sizeof(vec4)) != 0 ||
+            memcmp(&ba.v, &bb.v, sizeof(vec3)) != 0 ||
+            memcmp(&ba.w, &bb.w, sizeof(vec3)) != 0) return false;
+    }
+
+    return true;
+}
+
+int main(int, char **)
+{
+    //Suppress the output of adding bodies.
+    std::streambuf *coutBuffer = cout.rdbuf(nullptr);
+    std::vector<std::unique_ptr<DropSystem>> groupSystems;
+    std::vector<std::unique_ptr<DropSystem>> serialSystems;
+    rigid::RigidBodySystemGroup group(4);
+
+    for (int i = 0; i < 7; ++i)
+    {
+        groupSystems.push_back(std::make_unique<DropSystem>(4 + 3*i));
+        serialSystems.push_back(std::make_unique<DropSystem>(4 + 3*i));
+        group.addSystem(groupSystems.back().get());
+    }
+
+    cout.rdbuf(coutBuffer);
+
+    for (int i = 0; i < 240; ++i)
+    {
+        group.update(1.0f/60.0f);
+
+        for (auto &s : serialSystems)
+        {
+            s->update(1.0f/60.0f);
+        }
+
+        for (size_t j = 0; j < groupSystems.size(); ++j)
+        {
+            if (!isIdentical(*groupSystems[j], *serialSystems[j]))
+            {
+                cerr << "System " << j << " stepped by the group diverged from its serial copy at update " << i << "!" << endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    //Without explicit rebalancing, every system should have been updated by a single thread.
+    for (size_t j = 0; j < groupSystems.size(); ++j)
+    {
+        if (groupSystems[j]->nrThreadChanges != 1)
+        {
+            cerr << "System " << j << " was updated by " << groupSystems[j]->nrThreadChanges << " different threads!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    //Removing a system should leave the others on their threads.
+    std::vector<int> threads;
+
+    for (const auto &s : groupSystems)
+    {
+        threads.push_back(group.getSystemThread(s.get()));
+    }
+
+    group.removeSystem(groupSystems[2].get());
+
+    if (group.getSystemThread(groupSystems[2].get()) != -1)
+    {
+        cerr << "Removed system is still assigned to a thread!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    for (size_t j = 0; j < groupSystems.size(); ++j)
+    {
+        if (j != 2 && group.getSystemThread(groupSystems[j].get()) != threads[j])
+        {
+            cerr << "System " << j << " moved to another thread after removing an unrelated system!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    cerr << "Rigid body systems stepped by the group remained identical to serial updates." << endl;
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,92 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <cstdlib>
+
+#include <tiny/rigid/rigidbody.h>
+
+using namespace std;
+using namespace tiny;
+
+//Verify that moving an immovable body, e.g., a platform, also moves it in the broad phase.
+
+class PlatformSystem : public rigid::RigidBodySystem
+{
+    public:
+        PlatformSystem() :
+            RigidBodySystem()
+        {
+            platform = addImmovableSpheresRigidBody({vec4(0.0f, 0.0f, 0.0f, 1.0f)}, vec3(0.0f, 0.0f, 0.0f));
+            ball = addSpheresRigidBody(1.0f, {vec4(0.0f, 0.0f, 0.0f, 0.3f)}, vec3(5.0f, 2.0f, 0.0f));
+        }
+
+        ~PlatformSystem()
+        {
+
+        }
+
+        void movePlatform(const vec3 &x)
+        {
+            bodies[platform].x = x;
+        }
+
+        float getBallHeight() const
+        {
+            return bodies[ball].x.y;
+        }
+
+    protected:
+        void applyExternalForces()
+        {
+            for (auto &b : bodies)
+            {
+                b.f = vec3(0.0f, -9.81f/b.invM, 0.0f);
+            }
+        }
+
+    private:
+        int platform, ball;
+};
+
+int main(int, char **)
+{
+    //Suppress the output of adding bodies.
+    std::streambuf *coutBuffer = cout.rdbuf(nullptr);
+    PlatformSystem system;
+
+    cout.rdbuf(coutBuffer);
+    system.update(1.0f/60.0f);
+
+    //Move the platform underneath the falling ball, which should land on it.
+    system.movePlatform(vec3(5.0f, 0.0f, 0.0f));
+
+    for (int i = 0; i < 120; ++i)
+    {
+        system.update(1.0f/60.0f);
+    }
+
+    if (system.getBallHeight() < 1.0f)
+    {
+        cerr << "Ball fell through a moved immovable body (height " << system.getBallHeight() << ")!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    cerr << "Ball landed on the moved immovable body at height " << system.getBallHeight() << "." << endl;
+
+    return EXIT_SUCCESS;
+}
+
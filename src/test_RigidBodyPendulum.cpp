@@ -128,7 +128,6 @@ os::Application *application = 0;
 
 draw::WorldRenderer *worldRenderer = 0;
 
-std::vector<draw::StaticMeshInstance> sphereMeshInstances;
 draw::StaticMeshHorde *sphereMeshHorde = 0;
 draw::RGBATexture2D *sphereDiffuseTexture = 0;
 
@@ -184,10 +183,8 @@ void update(const double &dt)
         std::cerr << *rigidBodySystem;
     }
     
-    //Get rigid body positions and send them to the static mesh horde.
-    sphereMeshInstances.clear();
-    rigidBodySystem->getInternalSphereStaticMeshes(sphereMeshInstances);
-    sphereMeshHorde->setMeshes(sphereMeshInstances.begin(), sphereMeshInstances.end());
+    //Write rigid body positions directly into the static mesh horde.
+    sphereMeshHorde->setNrInstances(rigidBodySystem->writeInternalSphereStaticMeshes(sphereMeshHorde->getInstances(), sphereMeshHorde->getMaxNrInstances()));
 
     //Move the camera around.
     application->updateSimpleCamera(dt, cameraPosition, cameraOrientation);
@@ -0,0 +1,159 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include <tiny/rigid/rigidbody.h>
+
+using namespace std;
+using namespace tiny;
+
+//Verify that removing rigid bodies and constraints leaves the indices of all other bodies and constraints intact.
+
+class ChainSystem : public rigid::RigidBodySystem
+{
+    public:
+        ChainSystem() :
+            RigidBodySystem()
+        {
+            //Create a few pairs of bodies, each connected by a constraint.
+            for (int i = 0; i < 4; ++i)
+            {
+                const int j1 = addSpheresRigidBody(1.0f, {vec4(0.0f, 0.0f, 0.0f, 0.3f)}, vec3(2.0f*static_cast<float>(i), 1.0f, 0.0f));
+                const int j2 = addSpheresRigidBody(1.0f, {vec4(0.0f, 0.0f, 0.0f, 0.3f)}, vec3(2.0f*static_cast<float>(i), 2.0f, 0.0f));
+
+                addNonCollidingPair(j1, j2);
+                pairConstraints.push_back(addPositionConstraint(j1, vec3(0.0f, 0.5f, 0.0f), j2, vec3(0.0f, -0.5f, 0.0f)));
+                pairBodies.push_back({j1, j2});
+            }
+        }
+
+        ~ChainSystem()
+        {
+
+        }
+
+        bool connects(const int &c, const int &i1, const int &i2) const
+        {
+            return c >= 0 && c < static_cast<int>(constraints.size()) && constraints[c].b1.i == i1 && constraints[c].b2.i == i2;
+        }
+
+        std::vector<int> pairConstraints;
+        std::vector<std::pair<int, int>> pairBodies;
+
+    protected:
+        void applyExternalForces()
+        {
+            for (auto &b : bodies)
+            {
+                b.f = vec3(0.0f, -9.81f/b.invM, 0.0f);
+            }
+        }
+};
+
+int main(int, char **)
+{
+    //Suppress the output of adding and removing bodies.
+    std::streambuf *coutBuffer = cout.rdbuf(nullptr);
+    ChainSystem system;
+
+    system.update(1.0f/60.0f);
+
+    //Keep the state before any removals, to verify that restoring it also restores the non-colliding pairs.
+    rigid::RigidBodySystemSnapshot initial;
+
+    system.saveSnapshot(initial);
+
+    //Remove a body of the first pair, which should only remove the first constraint.
+    system.removeRigidBody(system.pairBodies[0].first);
+
+    if (!system.isConstraintRemoved(system.pairConstraints[0]))
+    {
+        cerr << "Constraint of a removed body was not removed!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < 4; ++i)
+    {
+        if (system.isConstraintRemoved(system.pairConstraints[i]) ||
+            !system.connects(system.pairConstraints[i], system.pairBodies[i].first, system.pairBodies[i].second))
+        {
+            cerr << "Constraint " << system.pairConstraints[i] << " changed after removing an unrelated body!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    //Remove a constraint directly and add new ones, which should reuse the free slots.
+    system.removeConstraint(system.pairConstraints[2]);
+    system.update(1.0f/60.0f);
+
+    const int c1 = system.addPositionConstraint(system.pairBodies[2].first, vec3(0.0f), system.pairBodies[3].first, vec3(0.0f), 2.0f);
+    const int c2 = system.addPositionConstraint(system.pairBodies[2].second, vec3(0.0f), system.pairBodies[3].second, vec3(0.0f), 2.0f);
+
+    if (std::min(c1, c2) != std::min(system.pairConstraints[0], system.pairConstraints[2]) ||
+        std::max(c1, c2) != std::max(system.pairConstraints[0], system.pairConstraints[2]))
+    {
+        cerr << "New constraints did not reuse the slots of removed constraints!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!system.connects(system.pairConstraints[1], system.pairBodies[1].first, system.pairBodies[1].second) ||
+        !system.connects(system.pairConstraints[3], system.pairBodies[3].first, system.pairBodies[3].second))
+    {
+        cerr << "Remaining constraints changed after adding new ones!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < 60; ++i)
+    {
+        system.update(1.0f/60.0f);
+    }
+
+    //Roll back to before the removals, which should bring back the removed body with its constraint and non-colliding pair.
+    rigid::RigidBodySystemSnapshot restored;
+
+    system.restoreSnapshot(initial);
+    system.saveSnapshot(restored);
+    std::sort(initial.nonCollidingBodies.begin(), initial.nonCollidingBodies.end());
+    std::sort(restored.nonCollidingBodies.begin(), restored.nonCollidingBodies.end());
+
+    if (restored.nonCollidingBodies != initial.nonCollidingBodies || restored.nonCollidingBodies.size() != 4)
+    {
+        cerr << "Restoring a snapshot did not restore the non-colliding pairs of removed bodies!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!system.connects(system.pairConstraints[0], system.pairBodies[0].first, system.pairBodies[0].second))
+    {
+        cerr << "Restoring a snapshot did not restore the constraint of a removed body!" << endl;
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < 60; ++i)
+    {
+        system.update(1.0f/60.0f);
+    }
+
+    cout.rdbuf(coutBuffer);
+    cerr << system;
+    cerr << "Constraint indices remained valid." << endl;
+
+    return EXIT_SUCCESS;
+}
+
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <vector>
 #include <string>
+#include <memory>
 #include <exception>
 
 #include <config.h>
@@ -67,9 +68,10 @@ class GravitySystem : public rigid::RigidBodySystem
     public:
         GravitySystem(const vec2 &a_terrainScale, const draw::FloatTexture2D *a_terrainHeightTexture) :
             RigidBodySystem(),
-            terrainScale(a_terrainScale),
-            terrainHeightTexture(a_terrainHeightTexture)
+            terrainCollider(a_terrainHeightTexture ? std::make_unique<rigid::HeightField>(*a_terrainHeightTexture, a_terrainScale) : nullptr)
         {
+            if (terrainCollider) addStaticCollider(terrainCollider.get());
+
             //Set terrain material properties to be extremely rough.
             bodies[0].staticFriction = 0.9f;
             bodies[0].dynamicFriction = 0.7f;
@@ -197,8 +199,7 @@ class GravitySystem : public rigid::RigidBodySystem
         int wheel1Suspension, wheel2Suspension, wheel3Suspension, wheel4Suspension;
         int wheel1Steering, wheel2Steering, wheel3Steering, wheel4Steering;
 
-        vec2 terrainScale;
-        const draw::FloatTexture2D *terrainHeightTexture;
+        std::unique_ptr<rigid::HeightField> terrainCollider;
 
         mesh::StaticMesh terrainCollisionMesh;
     
@@ -270,61 +271,26 @@ class GravitySystem : public rigid::RigidBodySystem
             return e;
         }
 
+#ifdef SHOW_COLLISION_MESH
         std::vector<vec3> getCollisionTriangles(const rigid::RigidBody &b)
         {
-            //Turn terrain close to this object into a set of triangles.
-            if (!terrainHeightTexture) return std::vector<vec3>();
-
-            const int xLo = std::floor((b.x.x - b.collisionRadius)/terrainScale.x + 0.5f*static_cast<float>(terrainHeightTexture->getWidth()));
-            const int yLo = std::floor((b.x.z - b.collisionRadius)/terrainScale.y + 0.5f*static_cast<float>(terrainHeightTexture->getHeight()));
-            const int xHi =  std::ceil((b.x.x + b.collisionRadius)/terrainScale.x + 0.5f*static_cast<float>(terrainHeightTexture->getWidth()));
-            const int yHi =  std::ceil((b.x.z + b.collisionRadius)/terrainScale.y + 0.5f*static_cast<float>(terrainHeightTexture->getHeight()));
-            std::vector<vec3> triangles;
+            //Show the terrain triangles close to this object, the actual collisions are handled by the height field.
+            std::vector<std::array<vec3, 3>> triangles;
 
-            triangles.reserve((xHi + 1 - xLo)*(yHi + 1 - yLo)*2*3);
+            if (terrainCollider) terrainCollider->getTriangles(vec4(b.x, b.collisionRadius), triangles);
 
-            //FIXME: This can be done far more efficiently.
-            for (int y = yLo; y <= yHi; ++y)
+            for (const auto &t : triangles)
             {
-                for (int x = xLo; x <= xHi; ++x)
+                for (const auto &v : t)
                 {
-                    const float h00 = (*terrainHeightTexture)(x + 0, y + 0).x;
-                    const float h01 = (*terrainHeightTexture)(x + 0, y + 1).x;
-                    const float h10 = (*terrainHeightTexture)(x + 1, y + 0).x;
-                    const float h11 = (*terrainHeightTexture)(x + 1, y + 1).x;
-
-                    triangles.push_back(vec3(terrainScale.x*(static_cast<float>(x) - 0.5f*static_cast<float>(terrainHeightTexture->getWidth())),
-                                             h00,
-                                             terrainScale.y*(static_cast<float>(y) - 0.5f*static_cast<float>(terrainHeightTexture->getHeight()))));
-                    triangles.push_back(vec3(terrainScale.x*(static_cast<float>(x + 1) - 0.5f*static_cast<float>(terrainHeightTexture->getWidth())),
-                                             h11,
-                                             terrainScale.y*(static_cast<float>(y + 1) - 0.5f*static_cast<float>(terrainHeightTexture->getHeight()))));
-                    triangles.push_back(vec3(terrainScale.x*(static_cast<float>(x + 1) - 0.5f*static_cast<float>(terrainHeightTexture->getWidth())),
-                                             h10,
-                                             terrainScale.y*(static_cast<float>(y) - 0.5f*static_cast<float>(terrainHeightTexture->getHeight()))));
-                    
-                    triangles.push_back(vec3(terrainScale.x*(static_cast<float>(x) - 0.5f*static_cast<float>(terrainHeightTexture->getWidth())),
-                                             h00,
-                                             terrainScale.y*(static_cast<float>(y) - 0.5f*static_cast<float>(terrainHeightTexture->getHeight()))));
-                    triangles.push_back(vec3(terrainScale.x*(static_cast<float>(x) - 0.5f*static_cast<float>(terrainHeightTexture->getWidth())),
-                                             h01,
-                                             terrainScale.y*(static_cast<float>(y + 1) - 0.5f*static_cast<float>(terrainHeightTexture->getHeight()))));   
-                    triangles.push_back(vec3(terrainScale.x*(static_cast<float>(x + 1) - 0.5f*static_cast<float>(terrainHeightTexture->getWidth())),
-                                             h11,
-                                             terrainScale.y*(static_cast<float>(y + 1) - 0.5f*static_cast<float>(terrainHeightTexture->getHeight()))));
+                    terrainCollisionMesh.indices.push_back(terrainCollisionMesh.vertices.size());
+                    terrainCollisionMesh.vertices.push_back(mesh::StaticMeshVertex(vec2(0.0f, 0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f), v));
                 }
             }
-
-#ifdef SHOW_COLLISION_MESH
-            for (const auto &t : triangles)
-            {
-                terrainCollisionMesh.indices.push_back(terrainCollisionMesh.vertices.size());
-                terrainCollisionMesh.vertices.push_back(mesh::StaticMeshVertex(vec2(0.0f, 0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f), t));
-            }
-#endif
             
-            return triangles;
+            return std::vector<vec3>();
         }
+#endif
 };
 
 os::Application *application = 0;
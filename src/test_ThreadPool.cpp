@@ -0,0 +1,72 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include <tiny/os/threadpool.h>
+
+using namespace std;
+using namespace tiny;
+
+//Verify that parallel loops cover every index exactly once, also after resizing the pool between jobs.
+
+bool runLoop(os::ThreadPool &pool, const int &n)
+{
+    std::vector<int> counts(n, 0);
+
+    pool.parallelFor(n, [&] (const int &begin, const int &end, const int &)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            ++counts[i];
+        }
+    });
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (counts[i] != 1) return false;
+    }
+
+    return true;
+}
+
+int main(int, char **)
+{
+    os::ThreadPool pool(4);
+    const std::vector<int> nrThreads = {4, 2, 1, 3, 8, 4, 2};
+
+    for (int i = 0; i < 100; ++i)
+    {
+        //Run some jobs before changing the number of threads, such that new workers start at a non-zero job generation.
+        for (int j = 0; j < 3; ++j)
+        {
+            if (!runLoop(pool, 1000 + 17*j))
+            {
+                cerr << "Parallel loop with " << pool.getNrThreads() << " threads did not cover all indices!" << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        
+        pool.setNrThreads(nrThreads[i % nrThreads.size()]);
+    }
+
+    cerr << "Thread pool loops remained correct after resizing." << endl;
+
+    return EXIT_SUCCESS;
+}
+
@@ -102,6 +102,18 @@ class Buffer : public BufferInterface
             GL_CHECK(glBindBuffer(target, 0));
         }
         
+        void sendToDevice(const size_t &a_size) const
+        {
+            //Only send the first a_size elements to the device.
+            assert(a_size <= hostData.size());
+            
+            if (a_size == 0) return;
+            
+            GL_CHECK(glBindBuffer(target, bufferIndex));
+            GL_CHECK(glBufferSubData(target, 0, a_size*sizeof(T), &hostData[0]));
+            GL_CHECK(glBindBuffer(target, 0));
+        }
+        
         bool empty() const
         {
             return (hostData.empty() || sizeInBytes == 0);
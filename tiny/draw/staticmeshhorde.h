@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <exception>
 #include <string>
+#include <algorithm>
 
 #include <cassert>
 
@@ -37,7 +38,10 @@ namespace draw
 
 struct StaticMeshInstance
 {
-    StaticMeshInstance()
+    StaticMeshInstance() :
+        positionAndSize(0.0f),
+        orientation(0.0f, 0.0f, 0.0f, 1.0f),
+        colorMultiplier(1.0f)
     {
 
     }
@@ -102,6 +106,24 @@ class StaticMeshHorde : public Renderable
             meshes.sendToDevice();
         }
         
+        //Direct access to the host copy of the instances, such that they can be written without an intermediate container.
+        //Call setNrInstances() afterwards to send the written instances to the device.
+        StaticMeshInstance *getInstances()
+        {
+            return &meshes[0];
+        }
+        
+        size_t getMaxNrInstances() const
+        {
+            return maxNrMeshes;
+        }
+        
+        void setNrInstances(const size_t &a_nrMeshes)
+        {
+            nrMeshes = std::min(a_nrMeshes, maxNrMeshes);
+            meshes.sendToDevice(nrMeshes);
+        }
+        
         std::string getVertexShaderCode() const;
         std::string getFragmentShaderCode() const;
         
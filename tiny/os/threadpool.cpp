@@ -0,0 +1,155 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cassert>
+#include <algorithm>
+
+#include <tiny/os/threadpool.h>
+
+using namespace tiny;
+using namespace tiny::os;
+
+inline int getRangeBoundary(const int &n, const int &thread, const int &nrThreads) noexcept
+{
+    //Avoid overflow for large loops.
+    return static_cast<int>((static_cast<long long>(n)*thread)/nrThreads);
+}
+
+ThreadPool::ThreadPool(const int &nrThreads) :
+    workers(),
+    job(nullptr),
+    jobSize(0),
+    jobNrThreads(1),
+    jobGeneration(0),
+    nrBusyWorkers(0),
+    stopping(false)
+{
+    setNrThreads(nrThreads);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stopWorkers();
+}
+
+void ThreadPool::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    startCondition.notify_all();
+
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+
+    workers.clear();
+    stopping = false;
+}
+
+void ThreadPool::setNrThreads(const int &nrThreads)
+{
+    //The calling thread counts as one of the threads.
+    const int nrWorkers = std::max(1, nrThreads) - 1;
+
+    if (nrWorkers == static_cast<int>(workers.size()))
+    {
+        return;
+    }
+
+    stopWorkers();
+
+    //New workers should only pick up jobs started after this point, so start them at the current generation.
+    for (int i = 0; i < nrWorkers; ++i)
+    {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i + 1, jobGeneration));
+    }
+}
+
+int ThreadPool::getNrThreads() const noexcept
+{
+    return static_cast<int>(workers.size()) + 1;
+}
+
+void ThreadPool::workerLoop(const int &thread, const unsigned int &startGeneration)
+{
+    unsigned int lastGeneration = startGeneration;
+
+    while (true)
+    {
+        const std::function<void (const int &, const int &, const int &)> *f = nullptr;
+        int n = 0;
+        int nrThreads = 1;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            startCondition.wait(lock, [&] {return stopping || jobGeneration != lastGeneration;});
+
+            if (stopping) return;
+
+            lastGeneration = jobGeneration;
+            f = job;
+            n = jobSize;
+            nrThreads = jobNrThreads;
+        }
+
+        (*f)(getRangeBoundary(n, thread, nrThreads), getRangeBoundary(n, thread + 1, nrThreads), thread);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (--nrBusyWorkers == 0) doneCondition.notify_one();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(const int &n, const std::function<void (const int &, const int &, const int &)> &f)
+{
+    const int nrThreads = getNrThreads();
+
+    //Avoid waking up the workers for small or serial loops.
+    if (nrThreads == 1 || n < nrThreads)
+    {
+        if (n > 0) f(0, n, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        assert(nrBusyWorkers == 0);
+        job = &f;
+        jobSize = n;
+        jobNrThreads = nrThreads;
+        nrBusyWorkers = static_cast<int>(workers.size());
+        ++jobGeneration;
+    }
+
+    startCondition.notify_all();
+
+    //Process our own share of the work.
+    f(0, getRangeBoundary(n, 1, nrThreads), 0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    doneCondition.wait(lock, [&] {return nrBusyWorkers == 0;});
+    job = nullptr;
+}
+
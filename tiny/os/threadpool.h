@@ -0,0 +1,69 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace tiny
+{
+
+namespace os
+{
+
+//A fixed set of worker threads that execute parallel loops.
+//The calling thread always participates as thread 0, so a pool with a single thread does not create any workers.
+class ThreadPool
+{
+    public:
+        ThreadPool(const int & = 1);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool & operator = (const ThreadPool &) = delete;
+
+        void setNrThreads(const int &);
+        int getNrThreads() const noexcept;
+
+        //Split [0, n) into getNrThreads() contiguous ranges and call f(begin, end, thread) for each of them.
+        //Thread t always receives the t-th range, such that results can be merged deterministically.
+        void parallelFor(const int &, const std::function<void (const int &, const int &, const int &)> &);
+
+    private:
+        void stopWorkers();
+        void workerLoop(const int &, const unsigned int &);
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable startCondition;
+        std::condition_variable doneCondition;
+
+        const std::function<void (const int &, const int &, const int &)> *job;
+        int jobSize;
+        int jobNrThreads;
+        unsigned int jobGeneration;
+        int nrBusyWorkers;
+        bool stopping;
+};
+
+} //os
+
+} //tiny
+
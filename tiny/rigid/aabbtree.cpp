@@ -15,17 +15,76 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <cassert>
+#include <iostream>
 #include <queue>
-#include <stack>
+#include <array>
 #include <algorithm>
 
 #include <tiny/rigid/aabbtree.h>
 
+#define TREESTACKSIZE 64
+
 using namespace tiny::aabb;
 
+//Stack of nodes or node pairs for the tree traversals, which only allocates for unusually deep trees.
+//Being local to each traversal, it is safe to use for concurrent queries.
+template <typename T>
+class TreeStack
+{
+    public:
+        TreeStack() :
+            nrFixed(0),
+            overflow()
+        {
+
+        }
+
+        inline bool empty() const noexcept
+        {
+            return nrFixed == 0;
+        }
+
+        inline void push(const T &i)
+        {
+            if (nrFixed < TREESTACKSIZE) fixed[nrFixed++] = i;
+            else overflow.push_back(i);
+        }
+
+        inline T pop() noexcept
+        {
+            //The overflow contains the most recently pushed nodes.
+            if (!overflow.empty())
+            {
+                const T i = overflow.back();
+
+                overflow.pop_back();
+
+                return i;
+            }
+
+            return fixed[--nrFixed];
+        }
+
+    private:
+        std::array<T, TREESTACKSIZE> fixed;
+        int nrFixed;
+        std::vector<T> overflow;
+};
+
+BroadPhase::BroadPhase()
+{
+
+}
+
+BroadPhase::~BroadPhase()
+{
+
+}
+
 //Based on Dynamic Bounding Volume Hierarchies by Erin Catto.
 
-Tree::Tree()
+Tree::Tree() :
+    BroadPhase()
 {
     clear();
 }
@@ -40,9 +99,20 @@ void Tree::clear()
     nodes.clear();
     freeNodes.clear();
     contentsToLeaf.clear();
+    nrLeaves = 0;
     root = -1;
 }
 
+size_t Tree::size() const noexcept
+{
+    return nrLeaves;
+}
+
+int Tree::getLeaf(const int &contents) const noexcept
+{
+    return (contents >= 0 && static_cast<size_t>(contents) < contentsToLeaf.size() ? contentsToLeaf[contents] : -1);
+}
+
 int Tree::insertNode(const Node &n)
 {
     int i;
@@ -83,50 +153,152 @@ float Tree::getCost() const
 aabb Tree::getNodeBox(const int &contents) const noexcept
 {
     //Get bounding box of an existing node.
-    auto ptr = contentsToLeaf.find(contents);
+    const int i = getLeaf(contents);
 
-    assert(ptr != contentsToLeaf.end());
+    assert(i >= 0);
 
-    return nodes[ptr->second].box;
+    return nodes[i].box;
 }
 
-std::set<std::pair<int, int>> Tree::getOverlappingContents() const noexcept
+void Tree::getOverlappingContents(std::vector<std::pair<int, int>> &pairs) const noexcept
 {
-    //Get all pairs of overlapping leaf AABBs, indexed by their contents.
-    std::set<std::pair<int, int>> pairs;
+    //Append all pairs of overlapping leaf AABBs, indexed by their contents as (smallest, largest), each pair once.
+    if (root < 0) return;
 
-    for (const auto & [c, i] : contentsToLeaf)
+    //Descend pairs of nodes simultaneously, starting with the root against itself.
+    TreeStack<std::pair<int, int>> s;
+
+    s.push(std::make_pair(root, root));
+
+    while (!s.empty())
     {
-        const aabb b = nodes[i].box;
+        const auto p = s.pop();
 
-        std::stack<int> s;
-        
-        assert(root >= 0);
-        s.push(root);
+        const Node &n1 = nodes[p.first];
 
-        while (!s.empty())
+        if (p.first == p.second)
         {
-            const auto n = nodes[s.top()];
-            s.pop();
-
-            if (n.isLeaf())
+            //A node against itself: compare both children with themselves and with each other.
+            if (!n1.isLeaf())
             {
-                //By earlier checks we should overlap with this node.
-                assert(overlapping(b, n.box));
-                if (c != n.contents) pairs.insert(std::minmax(c, n.contents));
-            }
-            else
-            {
-                //Does it make sense to recurse further?
-                assert(n.child1 >= 0);
-                assert(n.child2 >= 0);
-                if (overlapping(b, nodes[n.child1].box)) s.push(n.child1);
-                if (overlapping(b, nodes[n.child2].box)) s.push(n.child2);
+                s.push(std::make_pair(n1.child1, n1.child1));
+                s.push(std::make_pair(n1.child2, n1.child2));
+                s.push(std::make_pair(n1.child1, n1.child2));
             }
+
+            continue;
+        }
+
+        const Node &n2 = nodes[p.second];
+
+        if (!overlapping(n1.box, n2.box)) continue;
+
+        if (n1.isLeaf() && n2.isLeaf())
+        {
+            pairs.push_back(std::minmax(n1.contents, n2.contents));
+        }
+        else if (n2.isLeaf() || (!n1.isLeaf() && n1.box.getArea() >= n2.box.getArea()))
+        {
+            //Descend into the largest node.
+            s.push(std::make_pair(n1.child1, p.second));
+            s.push(std::make_pair(n1.child2, p.second));
+        }
+        else
+        {
+            s.push(std::make_pair(p.first, n2.child1));
+            s.push(std::make_pair(p.first, n2.child2));
         }
     }
+}
+
+void Tree::getOverlappingContents(const Tree &tree, std::vector<std::pair<int, int>> &pairs) const noexcept
+{
+    //Append all pairs (contents in this tree, contents in the other tree) of overlapping leaf AABBs.
+    if (root < 0 || tree.root < 0) return;
+
+    TreeStack<std::pair<int, int>> s;
 
-    return pairs;
+    s.push(std::make_pair(root, tree.root));
+
+    while (!s.empty())
+    {
+        const auto p = s.pop();
+
+        const Node &n1 = nodes[p.first];
+        const Node &n2 = tree.nodes[p.second];
+
+        if (!overlapping(n1.box, n2.box)) continue;
+
+        if (n1.isLeaf() && n2.isLeaf())
+        {
+            pairs.push_back(std::make_pair(n1.contents, n2.contents));
+        }
+        else if (n2.isLeaf() || (!n1.isLeaf() && n1.box.getArea() >= n2.box.getArea()))
+        {
+            s.push(std::make_pair(n1.child1, p.second));
+            s.push(std::make_pair(n1.child2, p.second));
+        }
+        else
+        {
+            s.push(std::make_pair(p.first, n2.child1));
+            s.push(std::make_pair(p.first, n2.child2));
+        }
+    }
+}
+
+void Tree::getOverlappingContents(const aabb &b, std::vector<int> &contents) const noexcept
+{
+    //Append the contents of all leaves whose AABB overlaps with the given box.
+    if (root < 0) return;
+
+    TreeStack<int> s;
+
+    s.push(root);
+
+    while (!s.empty())
+    {
+        const auto &n = nodes[s.pop()];
+
+        if (!overlapping(b, n.box)) continue;
+
+        if (n.isLeaf())
+        {
+            contents.push_back(n.contents);
+        }
+        else
+        {
+            s.push(n.child1);
+            s.push(n.child2);
+        }
+    }
+}
+
+void Tree::getRayContents(const vec3 &origin, const vec3 &direction, const float &maxDistance, const float &radius, std::vector<int> &contents) const noexcept
+{
+    //Append the contents of all leaves whose AABB, grown by the given radius, is hit by the segment origin + t*direction, 0 <= t <= maxDistance.
+    if (root < 0) return;
+
+    const vec3 invDirection = vec3(1.0f)/direction;
+    TreeStack<int> s;
+
+    s.push(root);
+
+    while (!s.empty())
+    {
+        const auto &n = nodes[s.pop()];
+
+        if (!aabb{n.box.lb - vec3(radius), n.box.ub + vec3(radius)}.isHitByRay(origin, invDirection, maxDistance)) continue;
+
+        if (n.isLeaf())
+        {
+            contents.push_back(n.contents);
+        }
+        else
+        {
+            s.push(n.child1);
+            s.push(n.child2);
+        }
+    }
 }
 
 void Tree::check() const
@@ -137,7 +309,7 @@ void Tree::check() const
     if (root < 0)
     {
         assert(size() == 0);
-        assert(contentsToLeaf.empty());
+        assert(nrLeaves == 0);
         assert(nodes.size() == freeNodes.size());
         return;
     }
@@ -171,12 +343,19 @@ void Tree::check() const
     assert(nodes[root].parent == -1);
     
     //Leaves should exactly be the content nodes.
-    for (const auto & [c, i] : contentsToLeaf)
+    int nrContents = 0;
+
+    for (const auto &i : contentsToLeaf)
     {
-        assert(i >= 0 && static_cast<size_t>(i) < nodes.size());
+        if (i < 0) continue;
+
+        assert(static_cast<size_t>(i) < nodes.size());
         assert(nodes[i].isLeaf());
+        ++nrContents;
     }
 
+    assert(nrContents == nrLeaves);
+
     //Check tree structure.
     std::vector<bool> used(nodes.size(), false);
     
@@ -201,7 +380,7 @@ void Tree::check() const
         //Check leaves.
         if (n.isLeaf())
         {
-            assert(contentsToLeaf.at(n.contents) == i);
+            assert(getLeaf(n.contents) == i);
             assert(n.child1 < 0 && n.child2 < 0);
         }
 
@@ -243,22 +422,34 @@ bool Tree::insert(const aabb &box, const int &contents)
     //Insert a node into the AABB tree.
     //std::cout << "INSERT " << contents << std::endl;
 
+#ifndef NDEBUG
     check();
+#endif
     
     //Do we already have this node?
-    if (contentsToLeaf.find(contents) != contentsToLeaf.end())
+    if (getLeaf(contents) >= 0)
     {
         return false;
     }
     
+    if (contents < 0)
+    {
+        std::cerr << "Contents of an AABB tree should be non-negative!" << std::endl;
+        assert(false);
+        return false;
+    }
+    
     const int newNode = insertNode({box, -1, -1, -1, contents});
-    contentsToLeaf.insert({contents, newNode});
+
+    if (static_cast<size_t>(contents) >= contentsToLeaf.size()) contentsToLeaf.resize(contents + 1, -1);
+    contentsToLeaf[contents] = newNode;
+    ++nrLeaves;
 
     //Was the tree empty?
     if (root == -1)
     {
         root = newNode;
-        assert(contentsToLeaf.size() == 1);
+        assert(nrLeaves == 1);
         return true;
     }
 
@@ -467,9 +658,9 @@ bool Tree::erase(const int &contents)
     //Remove a leaf node from the AABB tree.
     
     //We should already have this node.
-    auto iter = contentsToLeaf.find(contents);
+    const int a = getLeaf(contents);
 
-    if (iter == contentsToLeaf.end())
+    if (a < 0)
     {
         return false;
     }
@@ -482,8 +673,6 @@ bool Tree::erase(const int &contents)
     //   / \               |
     //  B   A
     //
-    const int a = iter->second;
-
     assert(nodes[a].isLeaf());
     
     if (a == root)
@@ -526,7 +715,8 @@ bool Tree::erase(const int &contents)
     
     eraseNode(c);
     eraseNode(a);
-    contentsToLeaf.erase(iter);
+    contentsToLeaf[contents] = -1;
+    --nrLeaves;
 
     return true;
 }
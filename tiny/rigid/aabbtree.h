@@ -20,6 +20,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <list>
 #include <map>
 #include <set>
+#include <cmath>
+#include <algorithm>
 
 #include <tiny/math/vec.h>
 
@@ -68,6 +70,73 @@ struct aabb
                (a.ub.y >= b.lb.y) && (b.ub.y >= a.lb.y) &&
                (a.ub.z >= b.lb.z) && (b.ub.z >= a.lb.z);
     }
+
+    inline bool isHitByRay(const vec3 &origin, const vec3 &invDirection, const float &maxDistance) const noexcept
+    {
+        //Slab test for the segment origin + t*direction, 0 <= t <= maxDistance, with invDirection = 1/direction.
+        //Zero direction components yield infinite inverses, for which we check the origin against the slab directly.
+        float tMin = 0.0f, tMax = maxDistance;
+        const auto slab = [&](const float &o, const float &i, const float &l, const float &u)
+        {
+            if (std::isinf(i)) return (o >= l && o <= u);
+            
+            const float t1 = (l - o)*i;
+            const float t2 = (u - o)*i;
+
+            tMin = std::max(tMin, std::min(t1, t2));
+            tMax = std::min(tMax, std::max(t1, t2));
+
+            return tMin <= tMax;
+        };
+
+        return slab(origin.x, invDirection.x, lb.x, ub.x) &&
+               slab(origin.y, invDirection.y, lb.y, ub.y) &&
+               slab(origin.z, invDirection.z, lb.z, ub.z);
+    }
+
+    inline bool clipSegment(const vec3 &origin, const vec3 &direction, float &tMin, float &tMax) const noexcept
+    {
+        //Restrict [tMin, tMax] to the part of origin + t*direction inside the box, such that unbounded rays become finite.
+        //Returns false if the segment misses the box.
+        const auto slab = [&](const float &o, const float &d, const float &l, const float &u)
+        {
+            if (d == 0.0f) return (o >= l && o <= u);
+
+            const float t1 = (l - o)/d;
+            const float t2 = (u - o)/d;
+
+            tMin = std::max(tMin, std::min(t1, t2));
+            tMax = std::min(tMax, std::max(t1, t2));
+
+            return true;
+        };
+
+        return slab(origin.x, direction.x, lb.x, ub.x) &&
+               slab(origin.y, direction.y, lb.y, ub.y) &&
+               slab(origin.z, direction.z, lb.z, ub.z) &&
+               tMin <= tMax;
+    }
+};
+
+//Interface for broad phase structures that store a bounding box for each non-negative contents index.
+class BroadPhase
+{
+    public:
+        BroadPhase();
+        virtual ~BroadPhase();
+        
+        virtual void clear() = 0;
+        virtual bool insert(const aabb &, const int &) = 0;
+        virtual bool erase(const int &) = 0;
+        virtual aabb getNodeBox(const int &) const noexcept = 0;
+        virtual void check() const = 0;
+        
+        //Append the contents of all boxes overlapping the given box, in an arbitrary order and without duplicates.
+        virtual void getOverlappingContents(const aabb &, std::vector<int> &) const noexcept = 0;
+        //Append the contents of all boxes, grown by the given radius, hit by the segment origin + t*direction, 0 <= t <= maxDistance.
+        virtual void getRayContents(const vec3 &, const vec3 &, const float &, const float &, std::vector<int> &) const noexcept = 0;
+        
+        virtual size_t size() const noexcept = 0;
 };
 
 struct Node
@@ -82,7 +151,7 @@ struct Node
     }
 };
 
-class Tree
+class Tree : public BroadPhase
 {
     public:
         Tree();
@@ -94,14 +163,16 @@ class Tree
         aabb getNodeBox(const int &) const noexcept;
         float getCost() const;
         void check() const;
-        std::set<std::pair<int, int>> getOverlappingContents() const noexcept;
+        void getOverlappingContents(std::vector<std::pair<int, int>> &) const noexcept;
+        void getOverlappingContents(const Tree &, std::vector<std::pair<int, int>> &) const noexcept;
+        void getOverlappingContents(const aabb &, std::vector<int> &) const noexcept;
+        void getRayContents(const vec3 &, const vec3 &, const float &, const float &, std::vector<int> &) const noexcept;
 
-        inline size_t size() const noexcept
-        {
-            return contentsToLeaf.size();
-        }
+        size_t size() const noexcept;
         
     private:
+        int getLeaf(const int &) const noexcept;
+
         int insertNode(const Node &);
         void eraseNode(const int &);
         void rebalance(const int &);
@@ -109,7 +180,9 @@ class Tree
         std::vector<Node> nodes;
         //TODO: Is an std::queue faster?
         std::vector<int> freeNodes;
-        std::map<int, int> contentsToLeaf;
+        //Leaf node for each non-negative contents index, or -1 if it is not in the tree.
+        std::vector<int> contentsToLeaf;
+        int nrLeaves;
         int root;
 };
 
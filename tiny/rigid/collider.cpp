@@ -0,0 +1,361 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include <tiny/rigid/collider.h>
+
+using namespace tiny;
+using namespace tiny::rigid;
+
+StaticCollider::StaticCollider()
+{
+
+}
+
+StaticCollider::~StaticCollider()
+{
+
+}
+
+HeightField::HeightField(const int &a_width, const int &a_height, const std::vector<float> &a_heights, const vec2 &a_scale) :
+    StaticCollider(),
+    width(a_width),
+    height(a_height),
+    scale(a_scale),
+    heights(a_heights)
+{
+    if (width < 0 || height < 0 || heights.size() != static_cast<size_t>(width)*static_cast<size_t>(height))
+    {
+        std::cerr << "Invalid height field dimensions!" << std::endl;
+        assert(false);
+        width = height = 0;
+        heights.clear();
+    }
+}
+
+HeightField::~HeightField()
+{
+
+}
+
+vec3 HeightField::getVertex(const int &x, const int &y) const noexcept
+{
+    //Height field vertices are centered around the origin.
+    return vec3(scale.x*(static_cast<float>(x) - 0.5f*static_cast<float>(width)),
+                heights[x + width*y],
+                scale.y*(static_cast<float>(y) - 0.5f*static_cast<float>(height)));
+}
+
+void HeightField::getTriangles(const vec4 &s, std::vector<std::array<vec3, 3>> &triangles) const noexcept
+{
+    //Only visit the texels underneath the sphere's footprint.
+    const int xLo = std::max(0, static_cast<int>(std::floor((s.x - s.w)/scale.x + 0.5f*static_cast<float>(width))));
+    const int yLo = std::max(0, static_cast<int>(std::floor((s.z - s.w)/scale.y + 0.5f*static_cast<float>(height))));
+    const int xHi = std::min(width - 2, static_cast<int>(std::floor((s.x + s.w)/scale.x + 0.5f*static_cast<float>(width))));
+    const int yHi = std::min(height - 2, static_cast<int>(std::floor((s.z + s.w)/scale.y + 0.5f*static_cast<float>(height))));
+
+    for (int y = yLo; y <= yHi; ++y)
+    {
+        for (int x = xLo; x <= xHi; ++x)
+        {
+            const vec3 p00 = getVertex(x + 0, y + 0);
+            const vec3 p01 = getVertex(x + 0, y + 1);
+            const vec3 p10 = getVertex(x + 1, y + 0);
+            const vec3 p11 = getVertex(x + 1, y + 1);
+
+            //Skip texels that lie entirely below the sphere.
+            if (std::max(std::max(p00.y, p01.y), std::max(p10.y, p11.y)) < s.y - s.w) continue;
+
+            triangles.push_back({{p00, p11, p10}});
+            triangles.push_back({{p00, p01, p11}});
+        }
+    }
+}
+
+//Maximum number of triangles per leaf and maximum depth of the bounding volume hierarchy.
+#define TMLEAFSIZE 4
+#define TMMAXDEPTH 64
+
+TriangleMesh::TriangleMesh(const std::vector<vec3> &vertices, const std::vector<unsigned int> &indices) :
+    StaticCollider()
+{
+    build(vertices, indices);
+}
+
+TriangleMesh::TriangleMesh(const mesh::StaticMesh &mesh, const vec3 &position, const vec4 &orientation) :
+    StaticCollider()
+{
+    //Place the mesh in the world.
+    const mat3 R = mat3::rotationMatrix(orientation);
+    std::vector<vec3> vertices;
+
+    vertices.reserve(mesh.vertices.size());
+
+    for (const auto &v : mesh.vertices)
+    {
+        vertices.push_back(position + R*v.position);
+    }
+
+    build(vertices, mesh.indices);
+}
+
+TriangleMesh::~TriangleMesh()
+{
+
+}
+
+void TriangleMesh::build(const std::vector<vec3> &vertices, const std::vector<unsigned int> &indices)
+{
+    //Build a static bounding volume hierarchy once by recursively splitting triangles at the median of their centroids.
+    triangles.clear();
+    nodes.clear();
+
+    for (size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        if (indices[i] >= vertices.size() || indices[i + 1] >= vertices.size() || indices[i + 2] >= vertices.size())
+        {
+            std::cerr << "Invalid triangle mesh index!" << std::endl;
+            assert(false);
+            continue;
+        }
+
+        triangles.push_back({{vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]}});
+    }
+
+    if (triangles.empty()) return;
+
+    std::vector<vec3> centroids(triangles.size());
+
+    for (size_t i = 0; i < triangles.size(); ++i)
+    {
+        centroids[i] = (triangles[i][0] + triangles[i][1] + triangles[i][2])/3.0f;
+    }
+
+    nodes.reserve(2*(triangles.size()/TMLEAFSIZE + 1));
+    buildNode(0, triangles.size(), 0, centroids);
+}
+
+int TriangleMesh::buildNode(const int &first, const int &last, const int &depth, std::vector<vec3> &centroids)
+{
+    //Create a node containing triangles [first, last).
+    //Nodes at depth TMMAXDEPTH - 1 become leaves, such that getTriangles() never exceeds its fixed stack.
+    aabb::aabb box = {triangles[first][0], triangles[first][0]};
+
+    for (int i = first; i < last; ++i)
+    {
+        for (const auto &p : triangles[i])
+        {
+            box = cup(box, aabb::aabb{p, p});
+        }
+    }
+
+    const int index = nodes.size();
+
+    nodes.push_back({box, -1, -1, first, last});
+
+    if (last - first <= TMLEAFSIZE || depth + 1 >= TMMAXDEPTH) return index;
+
+    //Split along the longest axis of the centroids' bounding box.
+    vec3 lb = centroids[first], ub = centroids[first];
+
+    for (int i = first; i < last; ++i)
+    {
+        lb = min(lb, centroids[i]);
+        ub = max(ub, centroids[i]);
+    }
+
+    const vec3 d = ub - lb;
+    const vec3 axis = (d.x >= d.y && d.x >= d.z ? vec3(1.0f, 0.0f, 0.0f) : (d.y >= d.z ? vec3(0.0f, 1.0f, 0.0f) : vec3(0.0f, 0.0f, 1.0f)));
+    const int middle = (first + last)/2;
+    std::vector<int> order(last - first);
+
+    for (int i = first; i < last; ++i)
+    {
+        order[i - first] = i;
+    }
+
+    std::nth_element(order.begin(), order.begin() + (middle - first), order.end(), [&](const int &a, const int &b)
+    {
+        return dot(centroids[a], axis) < dot(centroids[b], axis);
+    });
+
+    //Reorder triangles such that each child covers a contiguous range.
+    std::vector<std::array<vec3, 3>> sortedTriangles(last - first);
+    std::vector<vec3> sortedCentroids(last - first);
+
+    for (int i = 0; i < last - first; ++i)
+    {
+        sortedTriangles[i] = triangles[order[i]];
+        sortedCentroids[i] = centroids[order[i]];
+    }
+
+    std::copy(sortedTriangles.begin(), sortedTriangles.end(), triangles.begin() + first);
+    std::copy(sortedCentroids.begin(), sortedCentroids.end(), centroids.begin() + first);
+
+    const int child1 = buildNode(first, middle, depth + 1, centroids);
+    const int child2 = buildNode(middle, last, depth + 1, centroids);
+
+    nodes[index].child1 = child1;
+    nodes[index].child2 = child2;
+
+    return index;
+}
+
+void TriangleMesh::getTriangles(const vec4 &s, std::vector<std::array<vec3, 3>> &out) const noexcept
+{
+    //Walk the hierarchy for all triangles whose bounding box overlaps with the sphere's bounding box.
+    if (nodes.empty()) return;
+
+    const aabb::aabb box = {s.xyz() - vec3(s.w), s.xyz() + vec3(s.w)};
+    //The stack holds at most one pending node per level, plus one, which the capped depth of the hierarchy keeps within TMMAXDEPTH.
+    int stack[TMMAXDEPTH];
+    int nrStack = 0;
+
+    stack[nrStack++] = 0;
+
+    while (nrStack > 0)
+    {
+        const TriangleMeshNode &n = nodes[stack[--nrStack]];
+
+        if (!overlapping(box, n.box)) continue;
+
+        if (n.child1 < 0)
+        {
+            out.insert(out.end(), triangles.begin() + n.firstTriangle, triangles.begin() + n.lastTriangle);
+        }
+        else
+        {
+            assert(nrStack + 2 <= TMMAXDEPTH);
+            stack[nrStack++] = n.child1;
+            stack[nrStack++] = n.child2;
+        }
+    }
+}
+
+VoxelGrid::~VoxelGrid()
+{
+
+}
+
+size_t VoxelGrid::getIndex(const int &x, const int &y, const int &z) const noexcept
+{
+    return static_cast<size_t>(x) + static_cast<size_t>(width)*(static_cast<size_t>(y) + static_cast<size_t>(height)*static_cast<size_t>(z));
+}
+
+void VoxelGrid::setVoxel(const ivec3 &p, const bool &solid)
+{
+    if (p.x < 0 || p.y < 0 || p.z < 0 || p.x >= width || p.y >= height || p.z >= depth)
+    {
+        std::cerr << "Voxel " << p << " lies outside the voxel grid!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    voxels[getIndex(p.x, p.y, p.z)] = (solid ? 1 : 0);
+
+    //Removing voxels keeps empty regions empty, adding them does not.
+    if (solid)
+    {
+        std::fill(distances.begin(), distances.end(), 0);
+    }
+}
+
+bool VoxelGrid::getVoxel(const ivec3 &p) const noexcept
+{
+    //Everything outside the grid is empty.
+    if (p.x < 0 || p.y < 0 || p.z < 0 || p.x >= width || p.y >= height || p.z >= depth) return false;
+
+    return voxels[getIndex(p.x, p.y, p.z)] != 0;
+}
+
+void VoxelGrid::addFaces(const int &x, const int &y, const int &z, std::vector<std::array<vec3, 3>> &triangles) const noexcept
+{
+    //Add the faces of a solid voxel that are not covered by a neighbouring voxel, wound counter-clockwise seen from outside.
+    static const int directions[6][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+    static const int corners[6][4][3] = {{{0, 0, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}},
+                                         {{1, 0, 0}, {1, 1, 0}, {1, 1, 1}, {1, 0, 1}},
+                                         {{0, 0, 0}, {1, 0, 0}, {1, 0, 1}, {0, 0, 1}},
+                                         {{0, 1, 0}, {0, 1, 1}, {1, 1, 1}, {1, 1, 0}},
+                                         {{0, 0, 0}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}},
+                                         {{0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}}};
+
+    for (int f = 0; f < 6; ++f)
+    {
+        if (getVoxel(ivec3(x + directions[f][0], y + directions[f][1], z + directions[f][2]))) continue;
+
+        vec3 p[4];
+
+        for (int k = 0; k < 4; ++k)
+        {
+            p[k] = origin + scale*vec3(static_cast<float>(x + corners[f][k][0]), static_cast<float>(y + corners[f][k][1]), static_cast<float>(z + corners[f][k][2]));
+        }
+
+        triangles.push_back({{p[0], p[1], p[2]}});
+        triangles.push_back({{p[0], p[2], p[3]}});
+    }
+}
+
+void VoxelGrid::getTriangles(const vec4 &s, std::vector<std::array<vec3, 3>> &triangles) const noexcept
+{
+    //Work in voxel coordinates, where voxel (x, y, z) occupies [x, x + 1] x [y, y + 1] x [z, z + 1].
+    const vec3 c = (s.xyz() - origin)/scale;
+    const float r = s.w/scale;
+    const int cx = static_cast<int>(std::floor(c.x));
+    const int cy = static_cast<int>(std::floor(c.y));
+    const int cz = static_cast<int>(std::floor(c.z));
+
+    //All voxels within distance d of an empty voxel are empty, so no solid voxel lies closer than d to any point inside it.
+    if (cx >= 0 && cy >= 0 && cz >= 0 && cx < width && cy < height && cz < depth &&
+        r < static_cast<float>(distances[getIndex(cx, cy, cz)])) return;
+
+    //Only visit the voxels overlapping the sphere's bounding box.
+    const int xLo = std::max(0, static_cast<int>(std::floor(c.x - r)));
+    const int yLo = std::max(0, static_cast<int>(std::floor(c.y - r)));
+    const int zLo = std::max(0, static_cast<int>(std::floor(c.z - r)));
+    const int xHi = std::min(width - 1, static_cast<int>(std::floor(c.x + r)));
+    const int yHi = std::min(height - 1, static_cast<int>(std::floor(c.y + r)));
+    const int zHi = std::min(depth - 1, static_cast<int>(std::floor(c.z + r)));
+
+    for (int z = zLo; z <= zHi; ++z)
+    {
+        for (int y = yLo; y <= yHi; ++y)
+        {
+            for (int x = xLo; x <= xHi; )
+            {
+                const size_t i = getIndex(x, y, z);
+
+                //Skip the empty voxels guaranteed by the distance map.
+                if (voxels[i] == 0)
+                {
+                    x += 1 + distances[i];
+                    continue;
+                }
+
+                //Skip voxels that do not touch the sphere.
+                const vec3 q = clamp(c, vec3(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z)), vec3(static_cast<float>(x + 1), static_cast<float>(y + 1), static_cast<float>(z + 1)));
+
+                if (length(q - c) <= r) addFaces(x, y, z, triangles);
+
+                ++x;
+            }
+        }
+    }
+}
+
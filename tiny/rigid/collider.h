@@ -0,0 +1,178 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <iostream>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <array>
+
+#include <tiny/math/vec.h>
+#include <tiny/mesh/staticmesh.h>
+#include <tiny/rigid/aabbtree.h>
+
+namespace tiny
+{
+
+namespace rigid
+{
+
+class StaticCollider
+{
+    public:
+        StaticCollider();
+        virtual ~StaticCollider();
+        
+        //Append all triangles that may intersect the given sphere (in world coordinates) to the output.
+        //This is called from multiple threads simultaneously, so it should not modify the collider.
+        virtual void getTriangles(const vec4 &, std::vector<std::array<vec3, 3>> &) const noexcept = 0;
+};
+
+class HeightField : public StaticCollider
+{
+    public:
+        HeightField(const int &, const int &, const std::vector<float> &, const vec2 &);
+        
+        //Create height field from a texture, with the same layout as used by draw::Terrain.
+        template <typename TextureType>
+        HeightField(const TextureType &texture, const vec2 &a_scale) :
+            StaticCollider(),
+            width(texture.getWidth()),
+            height(texture.getHeight()),
+            scale(a_scale),
+            heights(width*height)
+        {
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    heights[x + width*y] = texture(x, y).x;
+                }
+            }
+        }
+        
+        ~HeightField();
+        
+        void getTriangles(const vec4 &, std::vector<std::array<vec3, 3>> &) const noexcept;
+        
+    private:
+        vec3 getVertex(const int &, const int &) const noexcept;
+
+        int width, height;
+        vec2 scale;
+        std::vector<float> heights;
+};
+
+struct TriangleMeshNode
+{
+    aabb::aabb box;
+    int child1, child2; //Children of internal nodes, or -1 for leaves.
+    int firstTriangle, lastTriangle; //Range of triangles contained in a leaf.
+};
+
+class TriangleMesh : public StaticCollider
+{
+    public:
+        TriangleMesh(const std::vector<vec3> &, const std::vector<unsigned int> &);
+        TriangleMesh(const mesh::StaticMesh &, const vec3 & = vec3(0.0f, 0.0f, 0.0f), const vec4 & = vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        ~TriangleMesh();
+        
+        void getTriangles(const vec4 &, std::vector<std::array<vec3, 3>> &) const noexcept;
+        
+        inline size_t size() const noexcept
+        {
+            return triangles.size();
+        }
+        
+    private:
+        void build(const std::vector<vec3> &, const std::vector<unsigned int> &);
+        int buildNode(const int &, const int &, const int &, std::vector<vec3> &);
+
+        std::vector<std::array<vec3, 3>> triangles;
+        std::vector<TriangleMeshNode> nodes;
+};
+
+class VoxelGrid : public StaticCollider
+{
+    public:
+        //Create a voxel grid from a texture with the same layout as used by draw::VoxelMap.
+        //Voxels are solid if their first channel is non-zero and the third channel holds the distance map (see draw::VoxelMap::setDistanceMap).
+        //Voxel (x, y, z) occupies origin + scale*[x, x + 1] x [y, y + 1] x [z, z + 1].
+        template <typename TextureType>
+        VoxelGrid(const TextureType &texture, const float &a_scale, const vec3 &a_origin = vec3(0.0f, 0.0f, 0.0f)) :
+            StaticCollider(),
+            width(texture.getWidth()),
+            height(texture.getHeight()),
+            depth(texture.getDepth()),
+            scale(a_scale),
+            origin(a_origin),
+            voxels(),
+            distances()
+        {
+            setVoxels(texture);
+        }
+
+        ~VoxelGrid();
+
+        //Copy all voxels from a texture of the same size, e.g., after editing it.
+        template <typename TextureType>
+        void setVoxels(const TextureType &texture)
+        {
+            const size_t channels = texture.getChannels();
+
+            if (channels < 3 || texture.getWidth() != static_cast<size_t>(width) || texture.getHeight() != static_cast<size_t>(height) || texture.getDepth() != static_cast<size_t>(depth))
+            {
+                std::cerr << "Error: Need a texture of the same size with at least 3 channels for the voxel grid!" << std::endl;
+                assert(false);
+                return;
+            }
+
+            const size_t nrVoxels = static_cast<size_t>(width)*static_cast<size_t>(height)*static_cast<size_t>(depth);
+
+            voxels.resize(nrVoxels);
+            distances.resize(nrVoxels);
+
+            for (size_t i = 0; i < nrVoxels; ++i)
+            {
+                voxels[i] = (texture[channels*i] != 0 ? 1 : 0);
+                distances[i] = static_cast<uint8_t>(texture[channels*i + 2u]);
+            }
+        }
+
+        //Change a single voxel, adding a voxel invalidates the distance map, as done by draw::VoxelMap::clearDistanceMap().
+        void setVoxel(const ivec3 &, const bool &);
+        bool getVoxel(const ivec3 &) const noexcept;
+
+        void getTriangles(const vec4 &, std::vector<std::array<vec3, 3>> &) const noexcept;
+
+    private:
+        size_t getIndex(const int &, const int &, const int &) const noexcept;
+        void addFaces(const int &, const int &, const int &, std::vector<std::array<vec3, 3>> &) const noexcept;
+
+        int width, height, depth;
+        float scale;
+        vec3 origin;
+        std::vector<uint8_t> voxels;
+        //Number of voxels around each empty voxel in which all voxels are empty.
+        std::vector<uint8_t> distances;
+};
+
+}
+
+}
+
@@ -0,0 +1,444 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+#include <tiny/rigid/hashgrid.h>
+
+//Number of buckets (a power of two) and maximum number of cells a box can cover to be stored in the buckets.
+#define HGNRBUCKETS 4096
+#define HGMAXCELLS 64
+//Relative margin by which each step of a ray is grown, such that rounding errors do not skip any cells.
+#define HGRAYEPS 1.0e-4f
+
+using namespace tiny::aabb;
+
+HashGrid::HashGrid(const float &cellSize) :
+    BroadPhase(),
+    invCellSize(1.0f/cellSize)
+{
+    if (!(cellSize > 0.0f))
+    {
+        std::cerr << "Hash grid cell size should be positive!" << std::endl;
+        assert(false);
+        invCellSize = 1.0f;
+    }
+
+    clear();
+}
+
+HashGrid::~HashGrid()
+{
+
+}
+
+void HashGrid::clear()
+{
+    buckets.assign(HGNRBUCKETS, std::vector<int>());
+    largeContents.clear();
+    bounds.clear();
+    boxes.clear();
+    present.clear();
+    nrBoxes = 0;
+    nrBucketEntries = 0;
+}
+
+size_t HashGrid::size() const noexcept
+{
+    return nrBoxes;
+}
+
+bool HashGrid::getCells(const aabb &b, ivec3 &lb, ivec3 &ub) const noexcept
+{
+    //Get the range of cells covered by a box, or return false if the box covers too many cells.
+    const vec3 l = b.lb*invCellSize;
+    const vec3 u = b.ub*invCellSize;
+
+    if (!(u.x - l.x < HGMAXCELLS && u.y - l.y < HGMAXCELLS && u.z - l.z < HGMAXCELLS &&
+          std::abs(l.x) < 1.0e9f && std::abs(l.y) < 1.0e9f && std::abs(l.z) < 1.0e9f))
+    {
+        return false;
+    }
+
+    lb = ivec3(static_cast<int>(std::floor(l.x)), static_cast<int>(std::floor(l.y)), static_cast<int>(std::floor(l.z)));
+    ub = ivec3(static_cast<int>(std::floor(u.x)), static_cast<int>(std::floor(u.y)), static_cast<int>(std::floor(u.z)));
+
+    return (ub.x - lb.x + 1)*(ub.y - lb.y + 1)*(ub.z - lb.z + 1) <= HGMAXCELLS;
+}
+
+int HashGrid::getBucket(const int &x, const int &y, const int &z) const noexcept
+{
+    return ((static_cast<unsigned int>(x)*73856093u) ^ (static_cast<unsigned int>(y)*19349663u) ^ (static_cast<unsigned int>(z)*83492791u)) & (HGNRBUCKETS - 1);
+}
+
+void HashGrid::setBounds(const int &c, const aabb &b)
+{
+    //Store the box of the given contents, or an empty box if it is not in the buckets, and update the unions of all its ancestors.
+    const aabb empty = aabb{vec3(FLT_MAX), vec3(-FLT_MAX)};
+    int nrLeaves = bounds.size()/2;
+
+    if (c >= nrLeaves)
+    {
+        //Grow the tree to the next power of two and copy the existing leaves.
+        const int oldNrLeaves = nrLeaves;
+
+        nrLeaves = std::max(1, nrLeaves);
+        while (nrLeaves <= c) nrLeaves *= 2;
+
+        std::vector<aabb> newBounds(2*nrLeaves, empty);
+
+        std::copy(bounds.begin() + oldNrLeaves, bounds.end(), newBounds.begin() + nrLeaves);
+        bounds.swap(newBounds);
+
+        for (int i = nrLeaves - 1; i > 0; --i)
+        {
+            bounds[i] = cup(bounds[2*i], bounds[2*i + 1]);
+        }
+    }
+
+    int i = nrLeaves + c;
+
+    bounds[i] = b;
+
+    for (i /= 2; i > 0; i /= 2)
+    {
+        bounds[i] = cup(bounds[2*i], bounds[2*i + 1]);
+    }
+}
+
+bool HashGrid::insert(const aabb &box, const int &c)
+{
+    if (c < 0)
+    {
+        std::cerr << "Contents of a hash grid should be non-negative!" << std::endl;
+        assert(false);
+        return false;
+    }
+    
+    if (static_cast<size_t>(c) < present.size() && present[c])
+    {
+        return false;
+    }
+
+    if (static_cast<size_t>(c) >= present.size())
+    {
+        boxes.resize(c + 1);
+        present.resize(c + 1, false);
+    }
+
+    boxes[c] = box;
+    present[c] = true;
+    ++nrBoxes;
+
+    ivec3 lb, ub;
+
+    if (!getCells(box, lb, ub))
+    {
+        largeContents.push_back(c);
+        return true;
+    }
+
+    setBounds(c, box);
+
+    //Store the contents only once per bucket, also if several of its cells hash to the same bucket.
+    //Only this box is added during the loop, so an earlier occurrence is always at the back.
+    for (int z = lb.z; z <= ub.z; ++z)
+    {
+        for (int y = lb.y; y <= ub.y; ++y)
+        {
+            for (int x = lb.x; x <= ub.x; ++x)
+            {
+                std::vector<int> &bucket = buckets[getBucket(x, y, z)];
+
+                if (bucket.empty() || bucket.back() != c)
+                {
+                    bucket.push_back(c);
+                    ++nrBucketEntries;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool HashGrid::erase(const int &c)
+{
+    if (c < 0 || static_cast<size_t>(c) >= present.size() || !present[c])
+    {
+        return false;
+    }
+
+    present[c] = false;
+    --nrBoxes;
+
+    //Remove the contents from a list, if it is still present, without preserving order.
+    const auto remove = [&c](std::vector<int> &list)
+    {
+        const auto ptr = std::find(list.begin(), list.end(), c);
+
+        if (ptr == list.end()) return false;
+
+        *ptr = list.back();
+        list.pop_back();
+
+        return true;
+    };
+
+    ivec3 lb, ub;
+
+    if (!getCells(boxes[c], lb, ub))
+    {
+        remove(largeContents);
+        return true;
+    }
+
+    setBounds(c, aabb{vec3(FLT_MAX), vec3(-FLT_MAX)});
+
+    //A bucket shared by several cells of the box only holds the contents once.
+    for (int z = lb.z; z <= ub.z; ++z)
+    {
+        for (int y = lb.y; y <= ub.y; ++y)
+        {
+            for (int x = lb.x; x <= ub.x; ++x)
+            {
+                if (remove(buckets[getBucket(x, y, z)])) --nrBucketEntries;
+            }
+        }
+    }
+
+    return true;
+}
+
+aabb HashGrid::getNodeBox(const int &c) const noexcept
+{
+    assert(c >= 0 && static_cast<size_t>(c) < present.size() && present[c]);
+
+    return boxes[c];
+}
+
+void HashGrid::check() const
+{
+    //Check whether every box occurs once in the bucket of each of its cells and the buckets contain nothing else.
+    size_t nrEntries = 0, nrExpectedEntries = 0;
+    int nrPresent = 0;
+    std::vector<int> boxBuckets;
+
+    for (const auto &b : buckets)
+    {
+        nrEntries += b.size();
+    }
+
+    for (size_t c = 0; c < present.size(); ++c)
+    {
+        if (!present[c]) continue;
+
+        ivec3 lb, ub;
+
+        ++nrPresent;
+
+        if (!getCells(boxes[c], lb, ub))
+        {
+            assert(std::count(largeContents.begin(), largeContents.end(), static_cast<int>(c)) == 1);
+            continue;
+        }
+
+        boxBuckets.clear();
+
+        for (int z = lb.z; z <= ub.z; ++z)
+        {
+            for (int y = lb.y; y <= ub.y; ++y)
+            {
+                for (int x = lb.x; x <= ub.x; ++x)
+                {
+                    boxBuckets.push_back(getBucket(x, y, z));
+                }
+            }
+        }
+
+        std::sort(boxBuckets.begin(), boxBuckets.end());
+        boxBuckets.erase(std::unique(boxBuckets.begin(), boxBuckets.end()), boxBuckets.end());
+
+        for (const auto &i : boxBuckets)
+        {
+            if (std::count(buckets[i].begin(), buckets[i].end(), static_cast<int>(c)) != 1)
+            {
+                std::cerr << "Box " << c << " does not occur exactly once in hash grid bucket " << i << "!" << std::endl;
+                assert(false);
+            }
+        }
+
+        nrExpectedEntries += boxBuckets.size();
+    }
+
+    assert(nrPresent == nrBoxes);
+    assert(nrEntries == nrExpectedEntries);
+    assert(nrEntries == static_cast<size_t>(nrBucketEntries));
+}
+
+float HashGrid::getCellCost() const noexcept
+{
+    //Expected cost of visiting a single cell, relative to testing a single box.
+    return 1.0f + static_cast<float>(nrBucketEntries)/static_cast<float>(HGNRBUCKETS);
+}
+
+void HashGrid::getCellContents(const aabb &b, std::vector<int> &out) const noexcept
+{
+    //Append the contents of all boxes in the buckets overlapping with the given box.
+    if (bounds.empty() || !overlapping(b, bounds[1])) return;
+
+    //Only visit cells within the bounds of the boxes in the buckets.
+    const vec3 l = max(b.lb, bounds[1].lb)*invCellSize;
+    const vec3 u = min(b.ub, bounds[1].ub)*invCellSize;
+    const ivec3 lb = ivec3(static_cast<int>(std::floor(l.x)), static_cast<int>(std::floor(l.y)), static_cast<int>(std::floor(l.z)));
+    const ivec3 ub = ivec3(static_cast<int>(std::floor(u.x)), static_cast<int>(std::floor(u.y)), static_cast<int>(std::floor(u.z)));
+    const float nrCells = static_cast<float>(ub.x - lb.x + 1)*static_cast<float>(ub.y - lb.y + 1)*static_cast<float>(ub.z - lb.z + 1);
+
+    if (nrCells*getCellCost() > static_cast<float>(nrBoxes))
+    {
+        //Test the boxes directly if that is cheaper than visiting all cells.
+        for (int c = 0; c < static_cast<int>(present.size()); ++c)
+        {
+            ivec3 cLb, cUb;
+
+            if (present[c] && overlapping(b, boxes[c]) && getCells(boxes[c], cLb, cUb)) out.push_back(c);
+        }
+
+        return;
+    }
+
+    for (int z = lb.z; z <= ub.z; ++z)
+    {
+        for (int y = lb.y; y <= ub.y; ++y)
+        {
+            for (int x = lb.x; x <= ub.x; ++x)
+            {
+                for (const auto &c : buckets[getBucket(x, y, z)])
+                {
+                    if (!overlapping(b, boxes[c])) continue;
+
+                    //Only report a box in the first cell shared by it and the query, to avoid duplicates.
+                    ivec3 cLb, cUb;
+
+                    getCells(boxes[c], cLb, cUb);
+
+                    if (x == std::max(lb.x, cLb.x) && y == std::max(lb.y, cLb.y) && z == std::max(lb.z, cLb.z)) out.push_back(c);
+                }
+            }
+        }
+    }
+}
+
+void HashGrid::getOverlappingContents(const aabb &b, std::vector<int> &out) const noexcept
+{
+    //Append the contents of all boxes overlapping with the given box.
+    for (const auto &c : largeContents)
+    {
+        if (overlapping(b, boxes[c])) out.push_back(c);
+    }
+
+    getCellContents(b, out);
+}
+
+void HashGrid::getRayContents(const vec3 &origin, const vec3 &direction, const float &maxDistance, const float &radius, std::vector<int> &out) const noexcept
+{
+    //Append the contents of all boxes, grown by the given radius, hit by the segment origin + t*direction, 0 <= t <= maxDistance.
+    const vec3 invDirection = vec3(1.0f)/direction;
+    const auto isHit = [&](const int &c)
+    {
+        return aabb{boxes[c].lb - vec3(radius), boxes[c].ub + vec3(radius)}.isHitByRay(origin, invDirection, maxDistance);
+    };
+
+    for (const auto &c : largeContents)
+    {
+        if (isHit(c)) out.push_back(c);
+    }
+
+    if (bounds.empty()) return;
+
+    //Clip the segment against the bounds of the boxes in the buckets, grown by the radius, such that unbounded rays become finite.
+    float tMin = 0.0f, tMax = maxDistance;
+
+    if (!aabb{bounds[1].lb - vec3(radius), bounds[1].ub + vec3(radius)}.clipSegment(origin, direction, tMin, tMax)) return;
+
+    //Walk through the cells along the segment, per Amanatides and Woo, A Fast Voxel Traversal Algorithm for Ray Tracing, Eurographics, 1987.
+    //Each step gathers the boxes around the part of the segment inside the current cell.
+    const float cellSize = 1.0f/invCellSize;
+    const float margin = radius + HGRAYEPS*cellSize;
+    const vec3 start = origin + tMin*direction;
+    const vec3 end = origin + tMax*direction;
+    const vec3 d = (end - start)*invCellSize;
+    const float nrSteps = std::abs(d.x) + std::abs(d.y) + std::abs(d.z) + 3.0f;
+    const float nrCellsPerStep = std::pow(2.0f*margin*invCellSize + 1.0f, 3.0f);
+    const size_t first = out.size();
+
+    //Use a single query around the segment if walking would be more expensive than testing all boxes.
+    if (nrSteps*nrCellsPerStep*getCellCost() > static_cast<float>(nrBoxes))
+    {
+        getCellContents(aabb{min(start, end) - vec3(radius), max(start, end) + vec3(radius)}, out);
+    }
+    else
+    {
+        const auto getNextCrossing = [&](const float &o, const float &v)
+        {
+            const float cell = std::floor(o*invCellSize);
+
+            return (v == 0.0f ? FLT_MAX : tMin + ((v > 0.0f ? cell + 1.0f : cell)*cellSize - o)/v);
+        };
+        const auto getCrossingDistance = [&](const float &v)
+        {
+            return (v == 0.0f ? FLT_MAX : cellSize/std::abs(v));
+        };
+        vec3 tNext = vec3(getNextCrossing(start.x, direction.x), getNextCrossing(start.y, direction.y), getNextCrossing(start.z, direction.z));
+        const vec3 tDelta = vec3(getCrossingDistance(direction.x), getCrossingDistance(direction.y), getCrossingDistance(direction.z));
+        float t = tMin;
+
+        for (int i = 0; ; ++i)
+        {
+            //Fall back to a single query if rounding errors prevent us from making progress.
+            if (static_cast<float>(i) > nrSteps)
+            {
+                getCellContents(aabb{min(start, end) - vec3(radius), max(start, end) + vec3(radius)}, out);
+                break;
+            }
+
+            const float tExit = std::min(tMax, std::min(tNext.x, std::min(tNext.y, tNext.z)));
+            const vec3 p0 = origin + t*direction;
+            const vec3 p1 = origin + tExit*direction;
+
+            getCellContents(aabb{min(p0, p1) - vec3(margin), max(p0, p1) + vec3(margin)}, out);
+
+            if (tExit >= tMax) break;
+
+            //Advance to the next cell along the axis whose boundary is crossed first.
+            t = tExit;
+
+            if (tNext.x <= tNext.y && tNext.x <= tNext.z) tNext.x += tDelta.x;
+            else if (tNext.y <= tNext.z) tNext.y += tDelta.y;
+            else tNext.z += tDelta.z;
+        }
+    }
+
+    //Neighbouring steps can find the same boxes.
+    std::sort(out.begin() + first, out.end());
+    out.erase(std::unique(out.begin() + first, out.end()), out.end());
+    out.erase(std::remove_if(out.begin() + first, out.end(), [&](const int &c) {return !isHit(c);}), out.end());
+}
+
@@ -0,0 +1,70 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <vector>
+
+#include <tiny/math/vec.h>
+#include <tiny/rigid/aabbtree.h>
+
+namespace tiny
+{
+
+namespace aabb
+{
+
+//Uniform grid of cubic cells, hashed into a fixed number of buckets, such that the world need not be bounded.
+//Works best when the cell size is comparable to the size of the boxes; boxes covering many cells are stored separately and always tested.
+//Queries are restricted to the bounds of the boxes in the grid, and rays walk through the grid cell by cell.
+class HashGrid : public BroadPhase
+{
+    public:
+        HashGrid(const float & = 1.0f);
+        ~HashGrid();
+        
+        void clear();
+        bool insert(const aabb &, const int &);
+        bool erase(const int &);
+        aabb getNodeBox(const int &) const noexcept;
+        void check() const;
+        void getOverlappingContents(const aabb &, std::vector<int> &) const noexcept;
+        void getRayContents(const vec3 &, const vec3 &, const float &, const float &, std::vector<int> &) const noexcept;
+        size_t size() const noexcept;
+        
+    private:
+        bool getCells(const aabb &, ivec3 &, ivec3 &) const noexcept;
+        int getBucket(const int &, const int &, const int &) const noexcept;
+        void setBounds(const int &, const aabb &);
+        float getCellCost() const noexcept;
+        void getCellContents(const aabb &, std::vector<int> &) const noexcept;
+
+        float invCellSize;
+        std::vector<std::vector<int>> buckets;
+        //Contents of boxes that cover too many cells to be stored in the buckets.
+        std::vector<int> largeContents;
+        //Binary tree with the boxes stored in the buckets, indexed by contents, at its leaves and their union at the root.
+        std::vector<aabb> bounds;
+        std::vector<aabb> boxes;
+        std::vector<bool> present;
+        int nrBoxes;
+        int nrBucketEntries;
+};
+
+} //aabb
+
+} //tiny
+
@@ -18,7 +18,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <cassert>
 #include <exception>
 #include <algorithm>
+#include <array>
 #include <set>
+#include <iterator>
+#include <cstdint>
+#include <chrono>
 
 #include <tiny/rigid/triangle.h>
 #include <tiny/rigid/rigidbody.h>
@@ -34,6 +38,19 @@ using namespace tiny::rigid;
 #define RBMAXACC 10.0f
 #define RBAABBSCALE 1.05f
 #define RBAABBDT 0.5f
+//Maximum number of independent constraint batches and minimum batch size to solve in parallel.
+#define RBMAXCOLORS 64
+#define RBMINBATCHSIZE 64
+//Internal spheres of each body are padded to a multiple of this width for the narrow phase.
+#define RBSPHEREWIDTH 8
+//Bodies with more internal spheres than this get a bounding sphere hierarchy with leaves of at most this many spheres.
+#define RBSPHERELEAFSIZE 8
+//Maximum depth of the bounding sphere hierarchies, which bounds the stack needed to traverse two of them simultaneously.
+#define RBSPHERETREEDEPTH 32
+//Fraction of its smallest internal sphere radius that a body may move per substep or penetrate before its motion is clamped.
+#define RBTOIFRACTION 0.25f
+//Fraction of bodies in the broad phase that has to move before all overlapping pairs are found with a single traversal of the trees.
+#define RBPAIRTRAVERSALFRACTION 0.25f
 
 RigidBodySystem::RigidBodySystem(const int &a_nrSubSteps) :
     time(0.0f),
@@ -42,7 +59,34 @@ RigidBodySystem::RigidBodySystem(const int &a_nrSubSteps) :
     totalAngularMomentum(0.0f),
     bodies(),
     constraints(),
-    nrSubSteps(a_nrSubSteps)
+    freeConstraints(),
+    nrSubSteps(a_nrSubSteps),
+    nrCurrentSubSteps(a_nrSubSteps),
+    adaptiveSubStepsEnabled(false),
+    constraintTolerance(1.0e-3f),
+    minNrSubSteps(1),
+    maxNrSubSteps(16),
+    constraintError(0.0f),
+    broadPhaseType(RigidBodyBroadPhase::Tree),
+    tree(),
+    sortedAxis(),
+    hashGrid(),
+    broadPhase(&tree),
+    staticTree(),
+    nrFreeInternalSpheres(0),
+    nrFreeSphereTreeNodes(0),
+    threadPool(1),
+    sleepingEnabled(false),
+    sleepLinearVelocity(0.1f),
+    sleepAngularVelocity(0.1f),
+    sleepTime(1.0f),
+    speculativeContactsEnabled(false),
+    fastBodies(),
+    fastBodyCollisions(),
+    warmStartingEnabled(false),
+    warmStartFactor(0.9f),
+    statisticsEnabled(false),
+    statistics()
 {
     //Add rigid body 0 to contain triangles.
     //FIXME: This can be done more elegantly.
@@ -153,19 +197,279 @@ int RigidBodySystem::addSpheresRigidBody(const float &totalMass, const std::vect
     //TODO: Check E or E.transposed().
     const vec3 w = E.transposed()*a_w;
 
+    //Reuse the slot of a removed body if possible.
+    int index = bodies.size();
+
+    if (!freeBodies.empty())
+    {
+        index = freeBodies.back();
+        freeBodies.pop_back();
+        ++bodyGenerations[index];
+        bodiesOutsideBroadPhase.erase(std::find(bodiesOutsideBroadPhase.begin(), bodiesOutsideBroadPhase.end(), index));
+    }
+    else
+    {
+        bodies.emplace_back();
+        sphereTreeRanges.emplace_back();
+        sleepStates.emplace_back();
+        bodyInBroadPhase.push_back(false);
+        bodyInStaticTree.push_back(false);
+        bodyGenerations.push_back(0);
+    }
+
     //Add rigid body to system.
-    bodies.push_back({1.0f/totalMass, 1.0f/e, x, q, v, w, vec3(0.0f), vec3(0.0f),
-        true, true,
-        maxRadius, maxRadius, static_cast<int>(bodyInternalSpheres.size()), static_cast<int>(bodyInternalSpheres.size() + spheres.size()),
-        a_statFric, a_dynFric, a_rest, a_soft});
-    bodyInternalSpheres.insert(bodyInternalSpheres.end(), spheres.begin(), spheres.end());
+    const int firstSphere = allocateInternalSpheres(spheres.size());
+
+    bodies[index] = {1.0f/totalMass, 1.0f/e, x, q, v, w, vec3(0.0f), vec3(0.0f),
+        true, true, false, 1u, ~0u,
+        maxRadius, maxRadius, firstSphere, firstSphere + static_cast<int>(spheres.size()),
+        a_statFric, a_dynFric, a_rest, a_soft};
+    std::copy(spheres.begin(), spheres.end(), bodyInternalSpheres.begin() + firstSphere);
+
+    //Build a bounding sphere hierarchy for bodies with many internal spheres.
+    const int firstNode = sphereTreeNodes.size();
+
+    if (spheres.size() > RBSPHERELEAFSIZE)
+    {
+        const int first = sphereTreeIndices.size();
+
+        for (size_t i = 0; i < spheres.size(); ++i)
+        {
+            sphereTreeIndices.push_back(i);
+        }
+
+        buildSphereTree(spheres, first, sphereTreeIndices.size(), 0);
+    }
+
+    sphereTreeRanges[index] = {firstNode, static_cast<int>(sphereTreeNodes.size())};
+    sleepStates[index] = {0.0f, index, false, vec3(0.0f), vec3(0.0f)};
+
+    //Add rigid body to the broad phase.
+    broadPhase->insert(bodies[index].getAABB(RBAABBDT).scale(RBAABBSCALE), index);
+    bodyInBroadPhase[index] = true;
+    bodyInStaticTree[index] = false;
+    movedBodies.push_back(index);
+
+    std::cout << "Added " << spheres.size() << " spheres, index " << index << ", " << bodies[index];
+
+    return index;
+}
+
+int RigidBodySystem::allocateInternalSpheres(const int &n)
+{
+    //Find room for n internal spheres, preferably in a range left behind by a removed body.
+    for (size_t i = 0; i < freeInternalSpheres.size(); ++i)
+    {
+        auto &r = freeInternalSpheres[i];
+
+        if (r.second - r.first >= n)
+        {
+            const int first = r.first;
+
+            r.first += n;
+            nrFreeInternalSpheres -= n;
+
+            if (r.first == r.second)
+            {
+                freeInternalSpheres.erase(freeInternalSpheres.begin() + i);
+            }
+
+            return first;
+        }
+    }
+
+    bodyInternalSpheres.resize(bodyInternalSpheres.size() + n);
+
+    return bodyInternalSpheres.size() - n;
+}
+
+void RigidBodySystem::compactInternalSpheres()
+{
+    //Move the internal spheres and sphere hierarchies of all bodies together in body order, discarding those of removed bodies.
+    std::vector<vec4> spheres;
+    std::vector<RigidBodySphereNode> nodes;
+    std::vector<int> indices;
+
+    spheres.reserve(bodyInternalSpheres.size() - nrFreeInternalSpheres);
+    nodes.reserve(sphereTreeNodes.size() - nrFreeSphereTreeNodes);
+
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        RigidBody &b = bodies[i];
+        RigidBodySphereTreeRange &r = sphereTreeRanges[i];
+        const int first = spheres.size();
+
+        spheres.insert(spheres.end(), bodyInternalSpheres.begin() + b.firstInternalSphere, bodyInternalSpheres.begin() + b.lastInternalSphere);
+        b.lastInternalSphere = first + (b.lastInternalSphere - b.firstInternalSphere);
+        b.firstInternalSphere = first;
+
+        if (r.first < r.last)
+        {
+            const RigidBodySphereNode &root = sphereTreeNodes[r.first];
+            const int nodeShift = static_cast<int>(nodes.size()) - r.first;
+            const int indexShift = static_cast<int>(indices.size()) - root.first;
+
+            indices.insert(indices.end(), sphereTreeIndices.begin() + root.first, sphereTreeIndices.begin() + root.last);
+
+            for (int k = r.first; k < r.last; ++k)
+            {
+                RigidBodySphereNode n = sphereTreeNodes[k];
+
+                n.first += indexShift;
+                n.last += indexShift;
+
+                if (n.left >= 0)
+                {
+                    n.left += nodeShift;
+                    n.right += nodeShift;
+                }
+
+                nodes.push_back(n);
+            }
+
+            r = {r.first + nodeShift, r.last + nodeShift};
+        }
+    }
+
+    bodyInternalSpheres.swap(spheres);
+    sphereTreeNodes.swap(nodes);
+    sphereTreeIndices.swap(indices);
+    freeInternalSpheres.clear();
+    nrFreeInternalSpheres = 0;
+    nrFreeSphereTreeNodes = 0;
+}
+
+void RigidBodySystem::removeRigidBody(const int &i)
+{
+    //Remove a body together with its constraints, non-colliding pairs, and contacts, other constraints keep their indices.
+    if (i <= 0 || i >= static_cast<int>(bodies.size()) || isRigidBodyRemoved(i))
+    {
+        std::cerr << "Invalid rigid body to remove specified!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    std::cout << "Removing rigid body " << i << "." << std::endl;
+
+    //Bodies resting on this one should no longer sleep.
+    if (bodies[i].asleep)
+    {
+        wakeIsland(i);
+    }
+
+    pairs.erase(std::remove_if(pairs.begin(), pairs.end(), [&](const RigidBodyPair &p)
+    {
+        if (p.i1 != i && p.i2 != i) return false;
+
+        const int j = (p.i1 == i ? p.i2 : p.i1);
+
+        if (bodies[j].asleep) wakeIsland(j);
+
+        return true;
+    }), pairs.end());
+
+    for (int j = 0; j < static_cast<int>(constraints.size()); ++j)
+    {
+        if (constraints[j].b1.i == i || constraints[j].b2.i == i) removeConstraint(j);
+    }
+
+    warmStarts.erase(std::remove_if(warmStarts.begin(), warmStarts.end(), [&](const RigidBodyWarmStart &c)
+    {
+        return c.i1 == i || c.i2 == i;
+    }), warmStarts.end());
+
+    for (auto k = nonCollidingBodies.begin(); k != nonCollidingBodies.end(); )
+    {
+        if (static_cast<int>(*k >> 32) == i || static_cast<int>(*k & 0xffffffffu) == i) k = nonCollidingBodies.erase(k);
+        else ++k;
+    }
+
+    if (bodyInBroadPhase[i])
+    {
+        if (bodyInStaticTree[i]) staticTree.erase(i);
+        else broadPhase->erase(i);
+
+        bodyInBroadPhase[i] = false;
+        bodyInStaticTree[i] = false;
+        bodiesOutsideBroadPhase.insert(std::lower_bound(bodiesOutsideBroadPhase.begin(), bodiesOutsideBroadPhase.end(), i), i);
+    }
+
+    //Release the internal spheres and sphere hierarchy.
+    RigidBody &b = bodies[i];
+
+    if (b.firstInternalSphere < b.lastInternalSphere)
+    {
+        std::fill(bodyInternalSpheres.begin() + b.firstInternalSphere, bodyInternalSpheres.begin() + b.lastInternalSphere, vec4(0.0f));
+        freeInternalSpheres.push_back({b.firstInternalSphere, b.lastInternalSphere});
+        nrFreeInternalSpheres += b.lastInternalSphere - b.firstInternalSphere;
+    }
+
+    nrFreeSphereTreeNodes += sphereTreeRanges[i].last - sphereTreeRanges[i].first;
+    sphereTreeRanges[i] = {0, 0};
+
+    //Leave an immovable body without spheres behind that is skipped by the simulation.
+    b = {0.0f, vec3(0.0f), vec3(0.0f), vec4(0.0f, 0.0f, 0.0f, 1.0f), vec3(0.0f), vec3(0.0f), vec3(0.0f), vec3(0.0f),
+        false, false, false, 0u, 0u,
+        0.0f, 0.0f, 0, 0,
+        0.0f, 0.0f, 0.0f, 0.0f};
+    sleepStates[i] = {0.0f, i, false, vec3(0.0f), vec3(0.0f)};
+    ++bodyGenerations[i];
+    freeBodies.push_back(i);
+
+    //Compact internal spheres once more than half of them are unused.
+    if (2*nrFreeInternalSpheres > static_cast<int>(bodyInternalSpheres.size()) ||
+        2*nrFreeSphereTreeNodes > static_cast<int>(sphereTreeNodes.size()))
+    {
+        compactInternalSpheres();
+    }
+}
+
+void RigidBodySystem::removeRigidBody(const RigidBodyHandle &h)
+{
+    const int i = getRigidBodyIndex(h);
 
-    //Add rigid body to the AABB tree.
-    tree.insert(bodies.back().getAABB(RBAABBDT).scale(RBAABBSCALE), bodies.size() - 1);
+    if (i < 0)
+    {
+        std::cerr << "Rigid body handle refers to a removed body!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    removeRigidBody(i);
+}
+
+bool RigidBodySystem::isRigidBodyRemoved(const int &i) const noexcept
+{
+    return (bodyGenerations[i] & 1u) != 0;
+}
+
+RigidBodyHandle RigidBodySystem::getRigidBodyHandle(const int &i) const
+{
+    if (i < 0 || i >= static_cast<int>(bodies.size()))
+    {
+        std::cerr << "Invalid rigid body for handle specified!" << std::endl;
+        assert(false);
+        return {-1, 0};
+    }
+
+    return {i, bodyGenerations[i]};
+}
+
+int RigidBodySystem::getRigidBodyIndex(const RigidBodyHandle &h) const noexcept
+{
+    //Get the index of the body referred to by a handle, or -1 if that body has been removed.
+    if (h.index < 0 || h.index >= static_cast<int>(bodies.size()) || bodyGenerations[h.index] != h.generation || isRigidBodyRemoved(h.index))
+    {
+        return -1;
+    }
 
-    std::cout << "Added " << spheres.size() << " spheres, index " << bodies.size() - 1 << ", " << bodies.back();
+    return h.index;
+}
 
-    return bodies.size() - 1;
+int RigidBodySystem::getNrBodies() const noexcept
+{
+    //Number of bodies that have not been removed, including body 0.
+    return bodies.size() - freeBodies.size();
 }
 
 int RigidBodySystem::addImmovableSpheresRigidBody(const std::vector<vec4> &a_spheres, const vec3 &a_x,
@@ -187,7 +491,14 @@ void RigidBodySystem::addNonCollidingPair(const int &i1, const int &i2)
 {
     if (i1 >= 0 && i2 >= 0 && i1 < static_cast<int>(bodies.size()) && i2 < static_cast<int>(bodies.size()))
     {
-        nonCollidingBodies.insert(std::minmax(i1, i2));
+        const auto [j1, j2] = std::minmax(i1, i2);
+
+        nonCollidingBodies.insert((static_cast<uint64_t>(j1) << 32) | static_cast<uint64_t>(j2));
+
+        //Update the pair if the bodies are already overlapping.
+        const int p = findPair(i1, i2);
+
+        if (p >= 0) pairs[p].nonColliding = true;
     }
     else
     {
@@ -196,6 +507,36 @@ void RigidBodySystem::addNonCollidingPair(const int &i1, const int &i2)
     }
 }
 
+void RigidBodySystem::setCollisionLayers(const int &i, const uint32_t &layers, const uint32_t &mask)
+{
+    //Set the layers a body belongs to and the layers it collides with, two bodies collide only if each is in the other's mask.
+    //Static colliders and user-supplied triangles belong to the layers of body 0.
+    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    {
+        bodies[i].collisionLayers = layers;
+        bodies[i].collisionMask = mask;
+    }
+    else
+    {
+        std::cerr << "Invalid body for collision layers specified!" << std::endl;
+        assert(false);
+    }
+}
+
+void RigidBodySystem::addStaticCollider(const StaticCollider *collider)
+{
+    //Add static geometry to collide with, which remains owned by the caller.
+    if (collider)
+    {
+        staticColliders.push_back(collider);
+    }
+    else
+    {
+        std::cerr << "Invalid static collider specified!" << std::endl;
+        assert(false);
+    }
+}
+
 int RigidBodySystem::addPositionConstraint(const int &i1, const vec3 &r1, const int &i2, const vec3 &r2, const float &d, const float &alpha)
 {
     std::cout << "Adding position constraint between " << i1 << " " << r1 << " and " << i2 << " " << r2 << "." << std::endl;
@@ -207,9 +548,7 @@ int RigidBodySystem::addPositionConstraint(const int &i1, const vec3 &r1, const
         return 0;
     }
     
-    constraints.push_back(Constraint{{i1, 0, r1}, {i2, 0, r2}, Constraint::Position, vec3(0.0f), d, alpha, 0.0f, false});
-
-    return constraints.size() - 1;
+    return addConstraint(Constraint{{i1, 0, r1}, {i2, 0, r2}, Constraint::Position, vec3(0.0f), d, alpha, 0.0f, vec3(0.0f), false});
 }
 
 int RigidBodySystem::addPositionLineConstraint(const int &i1, const vec3 &r1, const vec3 &n, const int &i2, const vec3 &r2, const float &d, const float &alpha)
@@ -223,9 +562,7 @@ int RigidBodySystem::addPositionLineConstraint(const int &i1, const vec3 &r1, co
         return 0;
     }
     
-    constraints.push_back(Constraint{{i1, 0, r1}, {i2, 0, r2}, Constraint::PositionOnLine, n, d, alpha, 0.0f, false});
-    
-    return constraints.size() - 1;
+    return addConstraint(Constraint{{i1, 0, r1}, {i2, 0, r2}, Constraint::PositionOnLine, n, d, alpha, 0.0f, vec3(0.0f), false});
 }
 
 int RigidBodySystem::addAngularConstraint(const int &i1, const vec3 &r1, const int &i2, const vec3 &r2, const float &d, const float &alpha)
@@ -239,585 +576,2482 @@ int RigidBodySystem::addAngularConstraint(const int &i1, const vec3 &r1, const i
         return 0;
     }
     
-    constraints.push_back(Constraint{{i1, 0, normalize(r1)}, {i2, 0, normalize(r2)}, Constraint::Orientation, vec3(0.0f), d, alpha, 0.0f, false});
-
-    return constraints.size() - 1;
+    return addConstraint(Constraint{{i1, 0, normalize(r1)}, {i2, 0, normalize(r2)}, Constraint::Orientation, vec3(0.0f), d, alpha, 0.0f, vec3(0.0f), false});
 }
 
-void RigidBodySystem::getRigidBodyPositionAndOrientation(const int &i, vec3 &x, vec4 &q) const
+int RigidBodySystem::addConstraint(const Constraint &c)
 {
-    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    //Reuse the slot of a removed constraint if possible.
+    if (!freeConstraints.empty())
     {
-        x = bodies[i].x;
-        q = bodies[i].q;
+        const int index = freeConstraints.back();
+
+        freeConstraints.pop_back();
+        constraints[index] = c;
+
+        return index;
     }
+
+    constraints.push_back(c);
+
+    return constraints.size() - 1;
 }
 
-void RigidBodySystem::getRigidBodyVelocityAndAngularVelocity(const int &i, vec3 &v, vec3 &w) const
+void RigidBodySystem::removeConstraint(const int &i)
 {
-    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    //Leave an inactive constraint between body 0 and itself behind, which is never solved, such that other constraints keep their indices.
+    if (i < 0 || i >= static_cast<int>(constraints.size()) || isConstraintRemoved(i))
     {
-        v = bodies[i].v;
-        w = bodies[i].w;
+        std::cerr << "Invalid constraint to remove specified!" << std::endl;
+        assert(false);
+        return;
     }
+
+    //Bodies held in place by this constraint should no longer sleep.
+    if (bodies[constraints[i].b1.i].asleep) wakeIsland(constraints[i].b1.i);
+    if (bodies[constraints[i].b2.i].asleep) wakeIsland(constraints[i].b2.i);
+
+    constraints[i] = Constraint{{0, 0, vec3(0.0f)}, {0, 0, vec3(0.0f)}, Constraint::Position, vec3(0.0f), 0.0f, 0.0f, 0.0f, vec3(0.0f), false};
+    freeConstraints.push_back(i);
 }
 
-std::tuple<float, float, float> applyAngularConstraint(const float lambda,
-                             const float alpha,
-                             RigidBody *b1,
-                             RigidBody *b2,
-                             const vec3 &dq) noexcept
+bool RigidBodySystem::isConstraintRemoved(const int &i) const noexcept
 {
-    vec3 n = normalize(dq);
-    
-    //Do nothing if we are below numerical precision.
-    if (length(n) < 0.99f) return std::make_tuple(0.0f, 0.0f, 0.0f);
+    //Constraints between a body and itself cannot be added, so they mark removed constraints.
+    return constraints[i].b1.i == constraints[i].b2.i;
+}
 
-    const mat3 invI1 = b1->getInvI();
-    const mat3 invI2 = b2->getInvI();
-    const float w1 = dot(n, invI1*n);
-    const float w2 = dot(n, invI2*n);
-    const float dlambda = -(length(dq) + alpha*lambda)/(w1 + w2 + alpha);
-    
-    n *= dlambda;
+void RigidBodySystem::setNrThreads(const int &nrThreads)
+{
+    //Set the number of threads used for collision detection, including the calling thread.
+    threadPool.setNrThreads(nrThreads);
+}
 
-    if (b1->movable)
+int RigidBodySystem::getNrThreads() const noexcept
+{
+    return threadPool.getNrThreads();
+}
+
+void RigidBodySystem::setBroadPhase(const RigidBodyBroadPhase &type, const float &cellSize)
+{
+    //Move all bounding boxes to a different broad phase structure, where the cell size is only used by the hash grid.
+    //The boxes themselves do not change, so neither do the overlapping pairs.
+    std::vector<aabb::aabb> boxes(bodies.size());
+
+    for (size_t i = 0; i < bodies.size(); ++i)
     {
-        b1->q += 0.5f*quatmul(vec4(invI1*n, 0.0f), b1->q);
-        b1->q = normalize(b1->q);
+        if (bodyInBroadPhase[i] && !bodyInStaticTree[i]) boxes[i] = broadPhase->getNodeBox(i);
     }
-    
-    if (b2->movable)
+
+    broadPhase->clear();
+    broadPhaseType = type;
+
+    if (type == RigidBodyBroadPhase::Tree)
     {
-        b2->q -= 0.5f*quatmul(vec4(invI2*n, 0.0f), b2->q);
-        b2->q = normalize(b2->q);
+        broadPhase = &tree;
+    }
+    else if (type == RigidBodyBroadPhase::SortedAxis)
+    {
+        broadPhase = &sortedAxis;
+    }
+    else
+    {
+        hashGrid = aabb::HashGrid(cellSize);
+        broadPhase = &hashGrid;
+    }
+
+    broadPhase->clear();
+
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        if (bodyInBroadPhase[i] && !bodyInStaticTree[i]) broadPhase->insert(boxes[i], i);
     }
-    
-    return std::make_tuple(dlambda, w1, w2);
 }
 
-void applyAngularVelocityConstraint(RigidBody *b1,
-                             RigidBody *b2,
-                             const vec3 &dw) noexcept
+RigidBodyBroadPhase RigidBodySystem::getBroadPhase() const noexcept
 {
-    vec3 n = normalize(dw);
-    
-    //Do nothing if we are below numerical precision.
-    if (length(n) < 0.99f) return;
-
-    const mat3 invI1 = b1->getInvI();
-    const mat3 invI2 = b2->getInvI();
-    const float w1 = dot(n, invI1*n);
-    const float w2 = dot(n, invI2*n);
-    
-    n *= -length(dw)/(w1 + w2);
-    b1->w += invI1*n;
-    b2->w -= invI2*n;
+    return broadPhaseType;
 }
 
-std::tuple<float, float, float> applyPositionConstraint(const float lambda,
-                             const float alpha,
-                             RigidBody *b1,
-                             RigidBody *b2,
-                             const vec3 &p,
-                             const vec3 &dx) noexcept
+void RigidBodySystem::setRandomSeed(const unsigned int &seed)
 {
-    vec3 n = normalize(dx);
-    
-    //Do nothing if we are below numerical precision.
-    if (length(n) < 0.99f) return std::make_tuple(0.0f, 0.0f, 0.0f);
+    //Updates only depend on the system's state, its random seed, and the user's input, not on the number of threads.
+    //Hence, two systems with identical inputs and seeds remain bitwise identical, as required for lockstep simulation.
+    //This holds for the same binary, or builds with identical floating point behaviour, since the random numbers are drawn without standard library distributions.
+    random.seed(seed);
+}
 
-    const vec3 r1 = p - b1->x;
-    const vec3 r2 = p - b2->x;
-    const mat3 invI1 = b1->getInvI();
-    const mat3 invI2 = b2->getInvI();
-    const float w1 = b1->invM + dot(cross(r1, n), invI1*cross(r1, n));
-    const float w2 = b2->invM + dot(cross(r2, n), invI2*cross(r2, n));
-    const float dlambda = -(length(dx) + alpha*lambda)/(w1 + w2 + alpha);
-    
-    n *= dlambda;
+void RigidBodySystem::saveSnapshot(RigidBodySystemSnapshot &s) const
+{
+    //Copy the complete simulation state, reusing the storage of the snapshot.
+    s.time = time;
+    s.totalEnergy = totalEnergy;
+    s.totalLinearMomentum = totalLinearMomentum;
+    s.totalAngularMomentum = totalAngularMomentum;
+    s.bodies = bodies;
+    s.constraints = constraints;
+    s.freeConstraints = freeConstraints;
+    s.bodyInternalSpheres = bodyInternalSpheres;
+    s.sphereTreeNodes = sphereTreeNodes;
+    s.sphereTreeIndices = sphereTreeIndices;
+    s.sphereTreeRanges = sphereTreeRanges;
+    s.freeInternalSpheres = freeInternalSpheres;
+    s.nrFreeInternalSpheres = nrFreeInternalSpheres;
+    s.nrFreeSphereTreeNodes = nrFreeSphereTreeNodes;
+    s.bodyGenerations = bodyGenerations;
+    s.freeBodies = freeBodies;
+    s.nonCollidingBodies.assign(nonCollidingBodies.begin(), nonCollidingBodies.end());
+    s.sleepStates = sleepStates;
+    s.pairs = pairs;
+    s.warmStarts = warmStarts;
+    s.movedBodies = movedBodies;
+    s.bodiesOutsideBroadPhase = bodiesOutsideBroadPhase;
+    s.bodyInStaticTree = bodyInStaticTree;
+    s.nrCurrentSubSteps = nrCurrentSubSteps;
+    s.constraintError = constraintError;
+    s.broadPhaseType = broadPhaseType;
+
+    //Only copy the broad phase structure that is in use.
+    if (broadPhaseType == RigidBodyBroadPhase::Tree) s.tree = tree;
+    else if (broadPhaseType == RigidBodyBroadPhase::SortedAxis) s.sortedAxis = sortedAxis;
+    else s.hashGrid = hashGrid;
+
+    s.staticTree = staticTree;
+
+    s.random = random;
+}
 
-    if (b1->movable)
+void RigidBodySystem::restoreSnapshot(const RigidBodySystemSnapshot &s)
+{
+    //Restore the complete simulation state, such that subsequent updates are identical to those after the snapshot was taken.
+    //Settings such as static colliders and sleeping parameters are not part of the snapshot.
+    //Non-colliding pairs are, since removing a body also removes its pairs.
+    if (s.bodies.empty() || s.sleepStates.size() != s.bodies.size())
     {
-        b1->x += b1->invM*n;
-        b1->q += 0.5f*quatmul(vec4(invI1*cross(r1, n), 0.0f), b1->q);
-        b1->q = normalize(b1->q);
+        std::cerr << "Invalid rigid body system snapshot!" << std::endl;
+        assert(false);
+        return;
     }
-    
-    if (b2->movable)
+
+    time = s.time;
+    totalEnergy = s.totalEnergy;
+    totalLinearMomentum = s.totalLinearMomentum;
+    totalAngularMomentum = s.totalAngularMomentum;
+    bodies = s.bodies;
+    constraints = s.constraints;
+    freeConstraints = s.freeConstraints;
+    bodyInternalSpheres = s.bodyInternalSpheres;
+    sphereTreeNodes = s.sphereTreeNodes;
+    sphereTreeIndices = s.sphereTreeIndices;
+    sphereTreeRanges = s.sphereTreeRanges;
+    freeInternalSpheres = s.freeInternalSpheres;
+    nrFreeInternalSpheres = s.nrFreeInternalSpheres;
+    nrFreeSphereTreeNodes = s.nrFreeSphereTreeNodes;
+    bodyGenerations = s.bodyGenerations;
+    freeBodies = s.freeBodies;
+    nonCollidingBodies.clear();
+    nonCollidingBodies.insert(s.nonCollidingBodies.begin(), s.nonCollidingBodies.end());
+    sleepStates = s.sleepStates;
+    pairs = s.pairs;
+    warmStarts = s.warmStarts;
+    movedBodies = s.movedBodies;
+    bodiesOutsideBroadPhase = s.bodiesOutsideBroadPhase;
+    bodyInBroadPhase.assign(bodies.size(), true);
+
+    for (const auto &i : bodiesOutsideBroadPhase)
     {
-        b2->x -= b2->invM*n;
-        b2->q -= 0.5f*quatmul(vec4(invI2*cross(r2, n), 0.0f), b2->q);
-        b2->q = normalize(b2->q);
+        bodyInBroadPhase[i] = false;
     }
-    
-    return std::make_tuple(dlambda, w1, w2);
-}
 
-void applyVelocityConstraint(RigidBody *b1,
-                             RigidBody *b2,
-                             const vec3 &r1,
-                             const vec3 &r2,
-                             const vec3 &dv) noexcept
-{
+    bodyInStaticTree = s.bodyInStaticTree;
+    nrCurrentSubSteps = s.nrCurrentSubSteps;
+    constraintError = s.constraintError;
+    broadPhaseType = s.broadPhaseType;
+
+    if (broadPhaseType == RigidBodyBroadPhase::Tree)
+    {
+        tree = s.tree;
+        broadPhase = &tree;
+    }
+    else if (broadPhaseType == RigidBodyBroadPhase::SortedAxis)
+    {
+        sortedAxis = s.sortedAxis;
+        broadPhase = &sortedAxis;
+    }
+    else
+    {
+        hashGrid = s.hashGrid;
+        broadPhase = &hashGrid;
+    }
+
+    staticTree = s.staticTree;
+    random = s.random;
+}
+
+void RigidBodySystem::setStatistics(const bool &enabled)
+{
+    //Enable or disable gathering statistics for each update.
+    statisticsEnabled = enabled;
+    statistics = RigidBodyStatistics();
+}
+
+const RigidBodyStatistics &RigidBodySystem::getStatistics() const noexcept
+{
+    return statistics;
+}
+
+void RigidBodySystem::setSpeculativeContacts(const bool &enabled)
+{
+    //Keep contacts on the side where they were generated and clamp the motion of fast bodies to their time of impact.
+    //This prevents fast bodies from tunnelling through thin geometry at large time steps.
+    speculativeContactsEnabled = enabled;
+    fastBodyCollisions.clear();
+}
+
+void RigidBodySystem::setWarmStarting(const bool &enabled, const float &factor)
+{
+    //Initialize the solver with the given fraction of the multipliers of the previous substep, or the previous update for new contacts.
+    //This lets resting contacts and joints converge with fewer substeps.
+    warmStartingEnabled = enabled;
+    warmStartFactor = factor;
+    warmStarts.clear();
+
+    for (auto &c : constraints)
+    {
+        c.correction = vec3(0.0f);
+    }
+}
+
+void RigidBodySystem::setAdaptiveSubSteps(const bool &enabled, const float &tolerance, const int &a_minNrSubSteps, const int &a_maxNrSubSteps)
+{
+    //Choose the number of substeps of each update between the given bounds, based on the largest penetration or constraint violation left by the previous update.
+    //The count increases as soon as the error exceeds the tolerance, and decreases slowly once the error is well below it.
+    if (a_minNrSubSteps < 1 || a_maxNrSubSteps < a_minNrSubSteps)
+    {
+        std::cerr << "Invalid range of substeps " << a_minNrSubSteps << "--" << a_maxNrSubSteps << "!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    adaptiveSubStepsEnabled = enabled;
+    constraintTolerance = tolerance;
+    minNrSubSteps = a_minNrSubSteps;
+    maxNrSubSteps = a_maxNrSubSteps;
+    nrCurrentSubSteps = (enabled ? std::clamp(nrSubSteps, minNrSubSteps, maxNrSubSteps) : nrSubSteps);
+    constraintError = 0.0f;
+}
+
+int RigidBodySystem::getNrSubSteps() const noexcept
+{
+    return nrCurrentSubSteps;
+}
+
+float RigidBodySystem::getConstraintError(const std::vector<RigidBodyCollision> &collisions) const noexcept
+{
+    //Determine the largest penetration depth and constraint violation for the current body states.
+    float error = 0.0f;
+
+    for (const auto &c : collisions)
+    {
+        if (isActive(c.b1.i) || isActive(c.b2.i))
+        {
+            error = std::max(error, -initializeCollision(c).d);
+        }
+    }
+
+    for (const auto &c : constraints)
+    {
+        if (!isActive(c.b1.i) && !isActive(c.b2.i)) continue;
+
+        const RigidBody &b1 = bodies[c.b1.i];
+        const RigidBody &b2 = bodies[c.b2.i];
+        const vec3 r1 = transforms[c.b1.i].R*c.b1.r;
+        const vec3 r2 = transforms[c.b2.i].R*c.b2.r;
+        const vec3 dp = (b2.x + r2) - (b1.x + r1);
+        const vec3 n = transforms[c.b1.i].R*c.n;
+
+        switch (c.type)
+        {
+            case Constraint::Position:
+                error = std::max(error, length(dp) - c.d);
+                break;
+            case Constraint::PositionOnLine:
+                error = std::max(error, std::max(length(dp - dot(dp, n)*n), dot(dp, n) - c.d));
+                break;
+            case Constraint::Orientation:
+                error = std::max(error, length(cross(r1, r2)) - c.d);
+                break;
+        }
+    }
+
+    return error;
+}
+
+void RigidBodySystem::setSleeping(const bool &enabled, const float &linearVelocity, const float &angularVelocity, const float &a_time)
+{
+    //Deactivate islands of bodies that move slower than the given velocities for the given amount of time.
+    sleepingEnabled = enabled;
+    sleepLinearVelocity = linearVelocity;
+    sleepAngularVelocity = angularVelocity;
+    sleepTime = a_time;
+
+    if (!sleepingEnabled)
+    {
+        for (size_t i = 0; i < bodies.size(); ++i)
+        {
+            if (bodies[i].asleep) wakeIsland(i);
+        }
+    }
+}
+
+bool RigidBodySystem::isRigidBodyAsleep(const int &i) const
+{
+    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    {
+        return bodies[i].asleep;
+    }
+
+    return false;
+}
+
+void RigidBodySystem::wakeRigidBody(const int &i)
+{
+    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    {
+        sleepStates[i].restTime = 0.0f;
+        if (bodies[i].asleep) wakeIsland(i);
+    }
+}
+
+void RigidBodySystem::applyImpulse(const int &i, const vec3 &p, const vec3 &J)
+{
+    //Apply an impulse J at world position p to a body.
+    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    {
+        RigidBody &b = bodies[i];
+
+        if (b.movable)
+        {
+            wakeRigidBody(i);
+            b.v += b.invM*J;
+            b.w += b.getInvI()*cross(p - b.x, J);
+        }
+    }
+}
+
+bool RigidBodySystem::isActive(const int &i) const noexcept
+{
+    return bodies[i].movable && !bodies[i].asleep;
+}
+
+bool RigidBodySystem::isCollidable(const int &i) const noexcept
+{
+    //Can body i collide with anything at all?
+    return bodies[i].canCollide && bodies[i].collisionLayers != 0 && bodies[i].collisionMask != 0;
+}
+
+bool RigidBodySystem::layersCanCollide(const int &i1, const int &i2) const noexcept
+{
+    return (bodies[i1].collisionLayers & bodies[i2].collisionMask) != 0 && (bodies[i2].collisionLayers & bodies[i1].collisionMask) != 0;
+}
+
+void RigidBodySystem::updateBroadPhaseMembership()
+{
+    //Remove bodies that can no longer collide from the broad phase and reinsert those that can again.
+    //Immovable bodies are moved to the static tree with tight bounding boxes.
+    //This is checked every update, since derived systems may change canCollide, movable, and the collision layers directly.
+    const int nrBodies = bodies.size();
+    bool changed = false;
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        const bool collidable = isCollidable(i);
+        const bool immovable = collidable && !bodies[i].movable;
+
+        if (collidable == bodyInBroadPhase[i] && immovable == bodyInStaticTree[i]) continue;
+
+        if (bodyInStaticTree[i]) staticTree.erase(i);
+        else if (bodyInBroadPhase[i]) broadPhase->erase(i);
+
+        if (immovable) staticTree.insert(bodies[i].getAABB(0.0f), i);
+        else if (collidable) broadPhase->insert(bodies[i].getAABB(RBAABBDT).scale(RBAABBSCALE), i);
+
+        changed = changed || (collidable != bodyInBroadPhase[i]);
+        bodyInBroadPhase[i] = collidable;
+        bodyInStaticTree[i] = immovable;
+        movedBodies.push_back(i);
+    }
+
+    if (changed)
+    {
+        bodiesOutsideBroadPhase.clear();
+
+        for (int i = 0; i < nrBodies; ++i)
+        {
+            if (!bodyInBroadPhase[i]) bodiesOutsideBroadPhase.push_back(i);
+        }
+    }
+}
+
+aabb::aabb RigidBodySystem::getBroadPhaseBox(const int &i) const noexcept
+{
+    return (bodyInStaticTree[i] ? staticTree.getNodeBox(i) : broadPhase->getNodeBox(i));
+}
+
+void RigidBodySystem::getBroadPhaseOverlaps(const aabb::aabb &box, std::vector<int> &out) const noexcept
+{
+    broadPhase->getOverlappingContents(box, out);
+    staticTree.getOverlappingContents(box, out);
+}
+
+void RigidBodySystem::getBodiesOutsideBroadPhase(std::vector<int> &out) const noexcept
+{
+    //Queries should still find bodies that cannot collide, even though they are not part of the broad phase.
+    out.insert(out.end(), bodiesOutsideBroadPhase.begin(), bodiesOutsideBroadPhase.end());
+}
+
+void RigidBodySystem::wakeIsland(const int &i)
+{
+    //Wake up all bodies that fell asleep together with body i and dissolve their island.
+    int j = i;
+
+    do
+    {
+        const int next = sleepStates[j].nextInIsland;
+
+        bodies[j].asleep = false;
+        sleepStates[j].restTime = 0.0f;
+        sleepStates[j].wakeUp = false;
+        sleepStates[j].nextInIsland = j;
+        j = next;
+    }
+    while (j != i);
+}
+
+void RigidBodySystem::wakeDisturbedBodies()
+{
+    //Wake up sleeping bodies whose applied forces or velocities have been changed by the user.
+    //The forces are those of the last call to applyExternalForces() in the previous update, so a body reacts to a changed force one update later.
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        const RigidBody &b = bodies[i];
+        const RigidBodySleepState &s = sleepStates[i];
+
+        if (b.asleep && (s.wakeUp || b.v != vec3(0.0f) || b.w != vec3(0.0f) ||
+            length(b.f - s.f) > RBEPS*(1.0f + length(s.f)) || length(b.t - s.t) > RBEPS*(1.0f + length(s.t))))
+        {
+            wakeIsland(i);
+        }
+    }
+}
+
+int RigidBodySystem::findIsland(const int &i)
+{
+    //Find island representative with path halving.
+    int j = i;
+
+    while (islandParents[j] != j)
+    {
+        islandParents[j] = islandParents[islandParents[j]];
+        j = islandParents[j];
+    }
+
+    return j;
+}
+
+void RigidBodySystem::updateSleepingBodies(const float &dt, const std::vector<RigidBodyCollision> &collisions)
+{
+    //Track how long each active body has been at rest.
+    const int nrBodies = bodies.size();
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        const RigidBody &b = bodies[i];
+
+        if (isActive(i))
+        {
+            if (length(b.v) < sleepLinearVelocity && length(b.w) < sleepAngularVelocity) sleepStates[i].restTime += dt;
+            else sleepStates[i].restTime = 0.0f;
+        }
+    }
+
+    //Gather islands of active bodies that touch or are constrained to each other.
+    islandParents.resize(nrBodies);
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        islandParents[i] = i;
+    }
+
+    const auto join = [&](const int &i1, const int &i2)
+    {
+        if (isActive(i1) && isActive(i2)) islandParents[findIsland(i1)] = findIsland(i2);
+    };
+
+    //Use all potential collisions, such that bodies resting close to each other fall asleep together.
+    for (const auto &c : collisions)
+    {
+        join(c.b1.i, c.b2.i);
+    }
+
+    for (const auto &c : constraints)
+    {
+        join(c.b1.i, c.b2.i);
+    }
+
+    //An island can only sleep if all of its bodies have been at rest long enough.
+    //Use the rest time of the representative to store the minimum over the island.
+    islandRestTimes.assign(nrBodies, 0.0f);
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        if (isActive(i)) islandRestTimes[i] = sleepStates[i].restTime;
+    }
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        if (isActive(i))
+        {
+            const int r = findIsland(i);
+
+            islandRestTimes[r] = std::min(islandRestTimes[r], sleepStates[i].restTime);
+        }
+    }
+
+    //Put islands to sleep and link their bodies in a circular list, such that they can be woken up together.
+    lastInIsland.assign(nrBodies, -1);
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        if (!isActive(i)) continue;
+
+        const int r = findIsland(i);
+
+        if (islandRestTimes[r] < sleepTime) continue;
+
+        RigidBody &b = bodies[i];
+        RigidBodySleepState &s = sleepStates[i];
+
+        b.v = vec3(0.0f);
+        b.w = vec3(0.0f);
+        s.f = b.f;
+        s.t = b.t;
+        s.wakeUp = false;
+
+        if (lastInIsland[r] < 0)
+        {
+            s.nextInIsland = i;
+        }
+        else
+        {
+            s.nextInIsland = sleepStates[lastInIsland[r]].nextInIsland;
+            sleepStates[lastInIsland[r]].nextInIsland = i;
+        }
+
+        lastInIsland[r] = i;
+        b.asleep = true;
+    }
+}
+
+bool RigidBodySystem::castSphereAtBody(const int &i, const vec3 &origin, const vec3 &direction, const float &radius, const float &maxDistance, RigidBodyRayHit &hit) const noexcept
+{
+    //Find the first internal sphere of body i hit by a sphere of the given radius moving from origin along the normalized direction.
+    const RigidBody &b = bodies[i];
+    const mat3 R = mat3::rotationMatrix(b.q);
+    bool found = false;
+
+    for (int iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
+    {
+        const vec4 s = vec4(b.x + R*bodyInternalSpheres[iS].xyz(), bodyInternalSpheres[iS].w);
+        const float r = s.w + radius;
+        const vec3 d = origin - s.xyz();
+        const float c = dot(d, d) - r*r;
+        const float e = dot(d, direction);
+
+        //Are we outside and moving away from the sphere or missing it entirely?
+        if (c > 0.0f && e > 0.0f) continue;
+
+        const float discriminant = e*e - c;
+
+        if (discriminant < 0.0f) continue;
+
+        //Start at the origin if it is already inside the sphere.
+        const float t = std::max(0.0f, -e - std::sqrt(discriminant));
+
+        if (t > maxDistance || (found && t >= hit.distance)) continue;
+
+        const vec3 delta = origin + t*direction - s.xyz();
+        const float l = length(delta);
+
+        hit.body = i;
+        hit.sphere = iS - b.firstInternalSphere;
+        hit.distance = t;
+        hit.n = (l > RBEPS*r ? delta/l : -direction);
+        hit.p = s.xyz() + s.w*hit.n;
+        found = true;
+    }
+
+    return found;
+}
+
+template <typename Function>
+void RigidBodySystem::forEachSphereCastHit(const vec3 &origin, const vec3 &a_direction, const float &radius, const float &maxDistance, const Function &f) const
+{
+    //Call f with the first hit of a sphere moving along the ray with each body.
+    //Candidates are gathered in a buffer per thread, such that repeated queries do not allocate and concurrent queries do not interfere.
+    static thread_local std::vector<int> candidates;
+    const float l = length(a_direction);
+
+    if (!(l > 0.0f))
+    {
+        std::cerr << "Invalid ray direction specified!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    const vec3 direction = a_direction/l;
+    RigidBodyRayHit hit;
+
+    candidates.clear();
+    broadPhase->getRayContents(origin, direction, maxDistance, radius, candidates);
+    staticTree.getRayContents(origin, direction, maxDistance, radius, candidates);
+    getBodiesOutsideBroadPhase(candidates);
+
+    for (const auto &i : candidates)
+    {
+        if (i > 0 && castSphereAtBody(i, origin, direction, radius, maxDistance, hit))
+        {
+            f(hit);
+        }
+    }
+}
+
+bool RigidBodySystem::castSphereFirst(const vec3 &origin, const vec3 &direction, const float &radius, const float &maxDistance, RigidBodyRayHit &hit) const
+{
+    //Find the closest hit, preferring the lowest body index for equal distances.
+    bool found = false;
+
+    forEachSphereCastHit(origin, direction, radius, maxDistance, [&](const RigidBodyRayHit &h)
+    {
+        if (!found || h.distance < hit.distance || (h.distance == hit.distance && h.body < hit.body))
+        {
+            hit = h;
+            found = true;
+        }
+    });
+
+    return found;
+}
+
+bool RigidBodySystem::castRay(const vec3 &origin, const vec3 &direction, RigidBodyRayHit &hit, const float &maxDistance) const
+{
+    //Find the first body hit by a ray.
+    return castSphereFirst(origin, direction, 0.0f, maxDistance, hit);
+}
+
+void RigidBodySystem::castRayAll(const vec3 &origin, const vec3 &direction, std::vector<RigidBodyRayHit> &hits, const float &maxDistance) const
+{
+    //Find all bodies hit by a ray, sorted by distance.
+    hits.clear();
+    forEachSphereCastHit(origin, direction, 0.0f, maxDistance, [&](const RigidBodyRayHit &h)
+    {
+        hits.push_back(h);
+    });
+
+    std::sort(hits.begin(), hits.end(), [](const RigidBodyRayHit &a, const RigidBodyRayHit &b)
+    {
+        return a.distance < b.distance || (a.distance == b.distance && a.body < b.body);
+    });
+}
+
+bool RigidBodySystem::castSphere(const vec4 &sphere, const vec3 &direction, RigidBodyRayHit &hit, const float &maxDistance) const
+{
+    //Find the first body hit by a sphere moving along a direction.
+    return castSphereFirst(sphere.xyz(), direction, sphere.w, maxDistance, hit);
+}
+
+void RigidBodySystem::getBodiesInSphere(const vec4 &sphere, std::vector<int> &out) const
+{
+    //Find all bodies of which an internal sphere overlaps with the given sphere.
+    //The candidates are gathered in the output and filtered in place, such that a reused output vector avoids allocations.
+    out.clear();
+    getBroadPhaseOverlaps(aabb::aabb{sphere.xyz() - vec3(sphere.w), sphere.xyz() + vec3(sphere.w)}, out);
+    getBodiesOutsideBroadPhase(out);
+
+    out.erase(std::remove_if(out.begin(), out.end(), [&](const int &i)
+    {
+        if (i == 0) return true;
+
+        const RigidBody &b = bodies[i];
+        const mat3 R = mat3::rotationMatrix(b.q);
+
+        for (int iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
+        {
+            const vec4 s = bodyInternalSpheres[iS];
+
+            if (length(b.x + R*s.xyz() - sphere.xyz()) <= s.w + sphere.w) return false;
+        }
+
+        return true;
+    }), out.end());
+
+    std::sort(out.begin(), out.end());
+}
+
+void RigidBodySystem::getBodiesInBox(const aabb::aabb &box, std::vector<int> &out) const
+{
+    //Find all bodies of which an internal sphere overlaps with the given box.
+    //The candidates are gathered in the output and filtered in place, such that a reused output vector avoids allocations.
+    out.clear();
+    getBroadPhaseOverlaps(box, out);
+    getBodiesOutsideBroadPhase(out);
+
+    out.erase(std::remove_if(out.begin(), out.end(), [&](const int &i)
+    {
+        if (i == 0) return true;
+
+        const RigidBody &b = bodies[i];
+        const mat3 R = mat3::rotationMatrix(b.q);
+
+        for (int iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
+        {
+            const vec4 s = bodyInternalSpheres[iS];
+            const vec3 c = b.x + R*s.xyz();
+
+            if (length(clamp(c, box.lb, box.ub) - c) <= s.w) return false;
+        }
+
+        return true;
+    }), out.end());
+
+    std::sort(out.begin(), out.end());
+}
+
+void RigidBodySystem::getRigidBodyPositionAndOrientation(const int &i, vec3 &x, vec4 &q) const
+{
+    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    {
+        x = bodies[i].x;
+        q = bodies[i].q;
+    }
+}
+
+void RigidBodySystem::getRigidBodyVelocityAndAngularVelocity(const int &i, vec3 &v, vec3 &w) const
+{
+    if (i >= 0 && i < static_cast<int>(bodies.size()))
+    {
+        v = bodies[i].v;
+        w = bodies[i].w;
+    }
+}
+
+void updateTransform(const RigidBody *b, RigidBodyTransform *t) noexcept
+{
+    //Equal to RigidBody::getInvI(), as rotationMatrix(quatconj(q)) is the transpose of rotationMatrix(q).
+    t->R = mat3::rotationMatrix(b->q);
+    t->invI = t->R*mat3::scaleMatrix(b->invI)*t->R.transposed();
+    t->valid = true;
+}
+
+inline void refreshTransform(const RigidBody *b, RigidBodyTransform *t) noexcept
+{
+    //Corrections only mark transforms as outdated, such that they are rebuilt once when they are needed.
+    if (!t->valid) updateTransform(b, t);
+}
+
+std::tuple<float, float, float> applyAngularConstraint(const float lambda,
+                             const float alpha,
+                             RigidBody *b1,
+                             RigidBodyTransform *t1,
+                             RigidBody *b2,
+                             RigidBodyTransform *t2,
+                             const vec3 &dq) noexcept
+{
+    vec3 n = normalize(dq);
+    
+    //Do nothing if we are below numerical precision.
+    if (length(n) < 0.99f) return std::make_tuple(0.0f, 0.0f, 0.0f);
+
+    refreshTransform(b1, t1);
+    refreshTransform(b2, t2);
+
+    const mat3 invI1 = t1->invI;
+    const mat3 invI2 = t2->invI;
+    const float w1 = dot(n, invI1*n);
+    const float w2 = dot(n, invI2*n);
+    const float dlambda = -(length(dq) + alpha*lambda)/(w1 + w2 + alpha);
+    
+    n *= dlambda;
+
+    if (b1->movable)
+    {
+        b1->q += 0.5f*quatmul(vec4(invI1*n, 0.0f), b1->q);
+        b1->q = normalize(b1->q);
+        t1->valid = false;
+    }
+    
+    if (b2->movable)
+    {
+        b2->q -= 0.5f*quatmul(vec4(invI2*n, 0.0f), b2->q);
+        b2->q = normalize(b2->q);
+        t2->valid = false;
+    }
+    
+    return std::make_tuple(dlambda, w1, w2);
+}
+
+void applyAngularVelocityConstraint(RigidBody *b1,
+                             const RigidBodyTransform *t1,
+                             RigidBody *b2,
+                             const RigidBodyTransform *t2,
+                             const vec3 &dw) noexcept
+{
+    vec3 n = normalize(dw);
+    
+    //Do nothing if we are below numerical precision.
+    if (length(n) < 0.99f) return;
+
+    const mat3 invI1 = t1->invI;
+    const mat3 invI2 = t2->invI;
+    const float w1 = dot(n, invI1*n);
+    const float w2 = dot(n, invI2*n);
+    
+    n *= -length(dw)/(w1 + w2);
+    if (b1->movable) b1->w += invI1*n;
+    if (b2->movable) b2->w -= invI2*n;
+}
+
+std::tuple<float, float, float> applyPositionConstraint(const float lambda,
+                             const float alpha,
+                             RigidBody *b1,
+                             RigidBodyTransform *t1,
+                             RigidBody *b2,
+                             RigidBodyTransform *t2,
+                             const vec3 &p,
+                             const vec3 &dx) noexcept
+{
+    vec3 n = normalize(dx);
+    
+    //Do nothing if we are below numerical precision.
+    if (length(n) < 0.99f) return std::make_tuple(0.0f, 0.0f, 0.0f);
+
+    refreshTransform(b1, t1);
+    refreshTransform(b2, t2);
+
+    const vec3 r1 = p - b1->x;
+    const vec3 r2 = p - b2->x;
+    const mat3 invI1 = t1->invI;
+    const mat3 invI2 = t2->invI;
+    const float w1 = b1->invM + dot(cross(r1, n), invI1*cross(r1, n));
+    const float w2 = b2->invM + dot(cross(r2, n), invI2*cross(r2, n));
+    const float dlambda = -(length(dx) + alpha*lambda)/(w1 + w2 + alpha);
+    
+    n *= dlambda;
+
+    if (b1->movable)
+    {
+        b1->x += b1->invM*n;
+        b1->q += 0.5f*quatmul(vec4(invI1*cross(r1, n), 0.0f), b1->q);
+        b1->q = normalize(b1->q);
+        t1->valid = false;
+    }
+    
+    if (b2->movable)
+    {
+        b2->x -= b2->invM*n;
+        b2->q -= 0.5f*quatmul(vec4(invI2*cross(r2, n), 0.0f), b2->q);
+        b2->q = normalize(b2->q);
+        t2->valid = false;
+    }
+    
+    return std::make_tuple(dlambda, w1, w2);
+}
+
+void applyAngularCorrection(RigidBody *b1,
+                             RigidBodyTransform *t1,
+                             RigidBody *b2,
+                             RigidBodyTransform *t2,
+                             const vec3 &n) noexcept
+{
+    //Apply a correction as accumulated by applyAngularConstraint().
+    refreshTransform(b1, t1);
+    refreshTransform(b2, t2);
+
+    if (b1->movable)
+    {
+        b1->q += 0.5f*quatmul(vec4(t1->invI*n, 0.0f), b1->q);
+        b1->q = normalize(b1->q);
+        t1->valid = false;
+    }
+    
+    if (b2->movable)
+    {
+        b2->q -= 0.5f*quatmul(vec4(t2->invI*n, 0.0f), b2->q);
+        b2->q = normalize(b2->q);
+        t2->valid = false;
+    }
+}
+
+void applyPositionCorrection(RigidBody *b1,
+                             RigidBodyTransform *t1,
+                             RigidBody *b2,
+                             RigidBodyTransform *t2,
+                             const vec3 &p,
+                             const vec3 &n) noexcept
+{
+    //Apply a correction as accumulated by applyPositionConstraint() at a given point.
+    const vec3 r1 = p - b1->x;
+    const vec3 r2 = p - b2->x;
+
+    refreshTransform(b1, t1);
+    refreshTransform(b2, t2);
+
+    if (b1->movable)
+    {
+        b1->x += b1->invM*n;
+        b1->q += 0.5f*quatmul(vec4(t1->invI*cross(r1, n), 0.0f), b1->q);
+        b1->q = normalize(b1->q);
+        t1->valid = false;
+    }
+    
+    if (b2->movable)
+    {
+        b2->x -= b2->invM*n;
+        b2->q -= 0.5f*quatmul(vec4(t2->invI*cross(r2, n), 0.0f), b2->q);
+        b2->q = normalize(b2->q);
+        t2->valid = false;
+    }
+}
+
+void applyVelocityConstraint(RigidBody *b1,
+                             const RigidBodyTransform *t1,
+                             RigidBody *b2,
+                             const RigidBodyTransform *t2,
+                             const vec3 &r1,
+                             const vec3 &r2,
+                             const vec3 &dv) noexcept
+{
     vec3 n = normalize(dv);
     
-    //Do nothing if we are below numerical precision.
-    if (length(n) < 0.99f) return;
+    //Do nothing if we are below numerical precision.
+    if (length(n) < 0.99f) return;
+
+    //FIXME: For proper momentum conservation we should have this:
+    //const vec3 r1 = p - b1->x;
+    //const vec3 r2 = p - b2->x;
+    const float w1 = b1->invM + dot(cross(r1, n), t1->invI*cross(r1, n));
+    const float w2 = b2->invM + dot(cross(r2, n), t2->invI*cross(r2, n));
+
+    n *= -length(dv)/(w1 + w2);
+
+    //Immovable bodies are shared between parallel solves, so never write to them.
+    if (b1->movable)
+    {
+        b1->v += b1->invM*n;
+        b1->w += t1->invI*cross(r1, n);
+    }
+    
+    if (b2->movable)
+    {
+        b2->v -= b2->invM*n;
+        b2->w -= t2->invI*cross(r2, n);
+    }
+}
+
+RigidBodyCollision RigidBodySystem::initializeCollision(RigidBodyCollision c) const noexcept
+{
+    //Evaluate for currently active body states.
+    const RigidBody *b1 = &bodies[c.b1.i];
+    const RigidBody *b2 = &bodies[c.b2.i];
+    const mat3 &R1 = transforms[c.b1.i].R;
+    const mat3 &R2 = transforms[c.b2.i].R;
+
+    assert(transforms[c.b1.i].valid && transforms[c.b2.i].valid);
+
+    vec4 is;
+    vec3 n, p1, p2;
+    float d;
+    
+    if (c.b1.i > 0 && c.b2.i > 0)
+    {
+        //Get potentially colliding internal spheres.
+        is = bodyInternalSpheres[b1->firstInternalSphere + c.b1.sphere];
+        const vec4 s1 = vec4(b1->x + R1*is.xyz(), is.w);
+        is = bodyInternalSpheres[b2->firstInternalSphere + c.b2.sphere];
+        const vec4 s2 = vec4(b2->x + R2*is.xyz(), is.w);
+
+        n = normalize(s2.xyz() - s1.xyz());
+
+        //Speculative contacts whose sphere centres have met or passed each other keep their original normal.
+        if (speculativeContactsEnabled && dot(s2.xyz() - s1.xyz(), c.m) <= 0.0f) n = c.m;
+
+        p1 = s1.xyz() + s1.w*n;
+        p2 = s2.xyz() - s2.w*n;
+        d = dot(s2.xyz() - s1.xyz(), n) - s1.w - s2.w;
+    }
+    else
+    {
+        //Case where we have a rigid body colliding with the triangle mesh.
+        assert(c.b1.i > 0 && c.b2.i == 0);
+
+        is = bodyInternalSpheres[b1->firstInternalSphere + c.b1.sphere];
+        const vec4 s1 = vec4(b1->x + R1*is.xyz(), is.w);
+        p2 = getClosestPointOnTriangle(s1.xyz(), c.t);
+        
+        n = normalize(p2 - s1.xyz());
+
+        //Speculative contacts of a sphere with its centre above or below the triangle use the triangle's normal at contact generation.
+        //This keeps the normal well-defined when the sphere's centre reaches or passes through the triangle.
+        if (speculativeContactsEnabled)
+        {
+            const vec3 dp = p2 - s1.xyz();
+
+            if (length(c.m) > 0.5f && dot(dp, c.m) < s1.w && length(dp - dot(dp, c.m)*c.m) <= RBEPS)
+            {
+                //Use the point on the triangle's plane along the normal, such that the correction does not add any torque.
+                n = c.m;
+                p2 = s1.xyz() + dot(dp, n)*n;
+            }
+        }
+
+        p1 = s1.xyz() + s1.w*n;
+        d = dot(p2 - s1.xyz(), n) - s1.w;
+    }
+
+    c.b1.r = R1.transposed()*(p1 - b1->x);
+    c.b2.r = R2.transposed()*(p2 - b2->x);
+    c.d = d;
+    c.n = n;
+
+    return c;
+}
+
+TwoRigidBodyPointGeometry RigidBodySystem::getWorldGeometry(const std::vector<RigidBody> &bodies, const PointOnRigidBody &b1, const PointOnRigidBody &b2) noexcept
+{
+    const RigidBody *pb1 = &bodies[b1.i];
+    const RigidBody *pb2 = &bodies[b2.i];
+    const vec3 r1 = mat3::rotationMatrix(pb1->q)*b1.r;
+    const vec3 r2 = mat3::rotationMatrix(pb2->q)*b2.r;
+
+    return TwoRigidBodyPointGeometry({pb1->x + r1,
+                                       pb2->x + r2,
+                                       pb1->v + cross(pb1->w, r1),
+                                       pb2->v + cross(pb2->w, r2)});
+}
+
+TwoRigidBodyPointGeometry RigidBodySystem::getWorldGeometry(const PointOnRigidBody &b1, const PointOnRigidBody &b2) const noexcept
+{
+    //Same as getWorldGeometry() above, but using the cached rotation matrices of the solver.
+    assert(transforms[b1.i].valid && transforms[b2.i].valid);
+
+    const RigidBody *pb1 = &bodies[b1.i];
+    const RigidBody *pb2 = &bodies[b2.i];
+    const vec3 r1 = transforms[b1.i].R*b1.r;
+    const vec3 r2 = transforms[b2.i].R*b2.r;
+
+    return TwoRigidBodyPointGeometry({pb1->x + r1,
+                                       pb2->x + r2,
+                                       pb1->v + cross(pb1->w, r1),
+                                       pb2->v + cross(pb2->w, r2)});
+}
+
+TwoRigidBodyPointGeometry RigidBodySystem::getPreWorldGeometry(const PointOnRigidBody &b1, const PointOnRigidBody &b2) const noexcept
+{
+    //Same as getWorldGeometry(), but for the body state at the start of the current substep.
+    const RigidBodySubStepState &p1 = preStates[b1.i];
+    const RigidBodySubStepState &p2 = preStates[b2.i];
+    const vec3 r1 = p1.R*b1.r;
+    const vec3 r2 = p2.R*b2.r;
+
+    return TwoRigidBodyPointGeometry({p1.x + r1,
+                                       p2.x + r2,
+                                       p1.v + cross(p1.w, r1),
+                                       p2.v + cross(p2.w, r2)});
+}
+
+aabb::aabb RigidBody::getAABB(const float &dt) const noexcept
+{
+    //Determine AABB with margin.
+    const float r = radius + 0.5f*dt*dt*RBMAXACC + RBEPS;
+    
+    return aabb::aabb{x - vec3(r) + min(vec3(0.0f), dt*v), x + vec3(r) + max(vec3(0.0f), dt*v)};
+}
+
+void RigidBodySystem::solveCollisionPosition(RigidBodyCollision &c, const float &h) noexcept
+{
+    //Check whether we have a collision for the current rigid body state.
+    refreshTransform(&bodies[c.b1.i], &transforms[c.b1.i]);
+    refreshTransform(&bodies[c.b2.i], &transforms[c.b2.i]);
+    c = initializeCollision(c);
+
+    //Check for collision for the current body states.
+    if (c.d <= 0.0f || c.forceToZero)
+    {
+        //Force constraint to be satisfied exactly if it is violated at least once.
+        c.forceToZero = true;
+
+        RigidBody *b1 = &bodies[c.b1.i];
+        RigidBody *b2 = &bodies[c.b2.i];
+        RigidBodyTransform *t1 = &transforms[c.b1.i];
+        RigidBodyTransform *t2 = &transforms[c.b2.i];
+
+        //When warm starting, apply the correction of the previous substep along the current normal first.
+        if (c.warmStart != 0.0f)
+        {
+            const auto wcg = getWorldGeometry(c.b1, c.b2);
+
+            applyPositionCorrection(b1, t1, b2, t2, 0.5f*(wcg.p1 + wcg.p2), c.warmStart*c.n);
+            refreshTransform(b1, t1);
+            refreshTransform(b2, t2);
+            c = initializeCollision(c);
+            c.lambda = c.warmStart;
+        }
+
+        const auto cg = getWorldGeometry(c.b1, c.b2);
+        const float softnessCoeff = 0.5f*(b1->softness + b2->softness)/(h*h);
+        
+        //Apply position constraint to avoid object interpenetration.
+        auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, t1, b2, t2, 0.5f*(cg.p1 + cg.p2), -c.d*c.n);
+        
+        c.lambda += l;
+        c.warmStart += (c.d < 0.0f ? l : -l);
+        
+        //Handle static friction.
+        const float staticFrictionCoeff = std::sqrt(b1->staticFriction*b2->staticFriction);
+        const auto precg = getPreWorldGeometry(c.b1, c.b2);
+        
+        //Figure out how the current collision point has moved w.r.t. the previous iteration on both bodies.
+        //N.B., we need to track a fixed point on the rigid body.
+        vec3 dx = (precg.p2 - cg.p2) - (precg.p1 - cg.p1);
+
+        dx -= dot(dx, c.n)*c.n;
+
+        //Inspect normal forces.
+        if (c.b2.i == 0 && false)
+        {
+            std::cout << "Normal force of " << c.b1.i << ": " << std::abs(c.lambda)/(h*h) << "N, coeff " << staticFrictionCoeff << std::endl;
+            std::cout << "Tangential force of " << c.b1.i << ": " << length(dx)/(h*h*(w1 + w2)) << "N, 1/w1 = " << 1.0f/w1 << "kg, 1/w2 = " << 1.0f/w2 << "kg" << std::endl;
+        }
+
+        //Static friction, restrict tangential motion if F_tangential <= mu_static * F_normal.
+        if (length(dx)/(w1 + w2) <= staticFrictionCoeff*std::abs(c.lambda))
+        {
+            applyPositionConstraint(0.0f, softnessCoeff, b1, t1, b2, t2, 0.5f*(cg.p1 + cg.p2), dx);
+        }
+    }
+    else
+    {
+        //Separated contacts have nothing to warm start the next substep with.
+        c.warmStart = 0.0f;
+    }
+}
+
+void RigidBodySystem::solveConstraintPosition(Constraint &c, const float &h) noexcept
+{
+    //Constraints between sleeping bodies are left alone.
+    if (!isActive(c.b1.i) && !isActive(c.b2.i)) return;
+
+    const float softnessCoeff = 0.5f*c.softness/(h*h);
+    RigidBody *b1 = &bodies[c.b1.i];
+    RigidBody *b2 = &bodies[c.b2.i];
+    RigidBodyTransform *t1 = &transforms[c.b1.i];
+    RigidBodyTransform *t2 = &transforms[c.b2.i];
+
+    refreshTransform(b1, t1);
+    refreshTransform(b2, t2);
+
+    //When warm starting, apply the correction of the previous substep first and keep the constraint active.
+    if (length2(c.correction) > 0.0f)
+    {
+        if (c.type == Constraint::Orientation)
+        {
+            applyAngularCorrection(b1, t1, b2, t2, c.correction);
+        }
+        else
+        {
+            const vec3 p1 = t1->R*c.b1.r + b1->x;
+            const vec3 p2 = t2->R*c.b2.r + b2->x;
+
+            applyPositionCorrection(b1, t1, b2, t2, (!b1->movable ? p2 : (!b2->movable ? p1 : 0.5f*(p1 + p2))), c.correction);
+        }
+
+        c.lambda = -length(c.correction);
+        c.forceToZero = true;
+        refreshTransform(b1, t1);
+        refreshTransform(b2, t2);
+    }
+
+    const vec3 p1 = t1->R*c.b1.r + b1->x;
+    const vec3 p2 = t2->R*c.b2.r + b2->x;
+    //FIXME: How to pick a good point where to apply the constraint?
+    const vec3 p = (!b1->movable ? p2 : (!b2->movable ? p1 : 0.5f*(p1 + p2)));
+    const vec3 n = t1->R*c.n;
+    const vec3 a = cross(t1->R*c.b1.r, t2->R*c.b2.r);
+    float d = 0.0f;
+
+    switch (c.type)
+    {
+        case Constraint::Position:
+            //Position constraint along all axes up to a maximum distance. (For d == 0 this is an equal-position-constraint.)
+            d = length(p2 - p1) - c.d;
+
+            if (d > 0.0f || c.forceToZero)
+            {
+                auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, t1, b2, t2, p, -d*normalize(p2 - p1));
+                c.forceToZero = true;
+                c.lambda += l;
+                c.correction += l*normalize(-d*normalize(p2 - p1));
+            }
+
+            break;
+        case Constraint::PositionOnLine:
+            //Position along a given line up to a maximum distance.
+
+            //First project delta on the line.
+            if (true)
+            {
+                auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, t1, b2, t2, p, -((p2 - p1) - dot(p2 - p1, n)*n));
+                c.lambda += l;
+                c.correction += l*normalize(-((p2 - p1) - dot(p2 - p1, n)*n));
+            }
+
+            //Then enforce the maximum extent we can move along the line.
+            d = dot(p2 - p1, n) - c.d;
+
+            if (d > 0.0f || c.forceToZero)
+            {
+                auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, t1, b2, t2, p, -d*n);
+                c.forceToZero = true;
+                c.lambda += l;
+                c.correction += l*normalize(-d*n);
+            }
+
+            break;
+        case Constraint::Orientation:
+            //Constrain relative orientation up to a maximum distance.
+            d = length(a) - c.d;
+            
+            if (d > 0.0f || c.forceToZero)
+            {
+                auto [l, w1, w2] = applyAngularConstraint(c.lambda, softnessCoeff, b1, t1, b2, t2, -d*normalize(a));
+                c.forceToZero = true;
+                c.lambda += l;
+                c.correction += l*normalize(-d*normalize(a));
+            }
+
+            break;
+        default:
+            break;
+    }
+}
+
+void RigidBodySystem::solveConstraintVelocity(const Constraint &c) noexcept
+{
+    if (c.forceToZero && (isActive(c.b1.i) || isActive(c.b2.i)))
+    {
+        const auto cg = getWorldGeometry(c.b1, c.b2);
+        RigidBody *b1 = &bodies[c.b1.i];
+        RigidBody *b2 = &bodies[c.b2.i];
+        const RigidBodyTransform *t1 = &transforms[c.b1.i];
+        const RigidBodyTransform *t2 = &transforms[c.b2.i];
+        const vec3 n = t1->R*c.n;
+        
+        switch (c.type)
+        {
+            case Constraint::Position:
+                //Should have relative velocity 0 at a position constraint.
+                applyVelocityConstraint(b1, t1, b2, t2, cg.p1 - b1->x, cg.p2 - b2->x, cg.v1 - cg.v2);
+                break;
+            case Constraint::PositionOnLine:
+                applyVelocityConstraint(b1, t1, b2, t2, cg.p1 - b1->x, cg.p2 - b2->x, dot(cg.v1 - cg.v2, n)*n);
+                break;
+            case Constraint::Orientation:
+                //TODO.
+                break;
+        }
+    }
+}
+
+void RigidBodySystem::solveCollisionVelocity(const RigidBodyCollision &c, const float &h) noexcept
+{
+    //Did we have a collision?
+    if (c.forceToZero)
+    {
+        const auto cg = getWorldGeometry(c.b1, c.b2);
+        RigidBody *b1 = &bodies[c.b1.i];
+        RigidBody *b2 = &bodies[c.b2.i];
+        const RigidBodyTransform *t1 = &transforms[c.b1.i];
+        const RigidBodyTransform *t2 = &transforms[c.b2.i];
+
+        //Determine normal and tangential relative velocities.
+        vec3 vt = cg.v1 - cg.v2;
+        const float vn = dot(vt, c.n);
+        
+        vt -= vn*c.n;
+        
+        //Apply dynamic friction.
+        const float dynamicFrictionCoeff = std::sqrt(b1->dynamicFriction*b2->dynamicFriction);
+
+        applyVelocityConstraint(b1, t1, b2, t2, cg.p1 - b1->x, cg.p2 - b2->x,
+                                std::min(dynamicFrictionCoeff*std::abs(c.lambda)/h, length(vt))*normalize(vt));
+        
+        //Perform restitution in case of collisions that are not resting contacts.
+
+        //Get pre-state normal velocity.
+        const auto precg = getPreWorldGeometry(c.b1, c.b2);
+        const float prevn = dot(precg.v1 - precg.v2, c.n);
+        const float restitutionCoeff = (std::abs(prevn) > h*RBMAXACC ? 
+                        std::sqrt(b1->restitution*b2->restitution) :
+                        0.0f);
+
+        applyVelocityConstraint(b1, t1, b2, t2, cg.p1 - b1->x, cg.p2 - b2->x,
+                                (vn + std::max(0.0f, restitutionCoeff*prevn))*c.n);
+    }
+}
+
+void RigidBodySystem::colorConstraintGraph(const std::vector<std::pair<int, int>> &edges, std::vector<int> &order, std::vector<int> &offsets)
+{
+    //Greedily color the graph with bodies as vertices and constraints as edges, such that constraints of equal color share no movable body.
+    //Immovable bodies are never written to by the solver, so they can be shared freely.
+    //Constraints that do not fit in the first RBMAXCOLORS colors are put in a final batch, which is solved serially.
+    bodyColorMasks.assign(bodies.size(), 0);
+    pairColors.resize(edges.size());
+
+    int nrColors = 0;
+
+    for (size_t i = 0; i < edges.size(); ++i)
+    {
+        const auto [i1, i2] = edges[i];
+        uint64_t used = 0;
+
+        if (bodies[i1].movable) used |= bodyColorMasks[i1];
+        if (bodies[i2].movable) used |= bodyColorMasks[i2];
+
+        int color = 0;
+
+        while (color < RBMAXCOLORS && (used & (uint64_t(1) << color)) != 0) ++color;
+
+        if (color < RBMAXCOLORS)
+        {
+            bodyColorMasks[i1] |= uint64_t(1) << color;
+            bodyColorMasks[i2] |= uint64_t(1) << color;
+        }
+
+        pairColors[i] = color;
+        nrColors = std::max(nrColors, color + 1);
+    }
+
+    //Sort constraints by color, retaining their relative order.
+    offsets.assign(nrColors + 1, 0);
+
+    for (const auto &c : pairColors)
+    {
+        ++offsets[c + 1];
+    }
+
+    for (int c = 0; c < nrColors; ++c)
+    {
+        offsets[c + 1] += offsets[c];
+    }
+
+    std::vector<int> next(offsets.begin(), offsets.end() - 1);
+
+    order.resize(edges.size());
+
+    for (size_t i = 0; i < edges.size(); ++i)
+    {
+        order[next[pairColors[i]]++] = i;
+    }
+}
+
+template <typename Function>
+void RigidBodySystem::solveBatches(const std::vector<int> &order, const std::vector<int> &offsets, const Function &f)
+{
+    //Solve batches one after another, distributing the constraints within each batch over all threads.
+    for (int c = 0; c + 1 < static_cast<int>(offsets.size()); ++c)
+    {
+        const int first = offsets[c];
+        const int n = offsets[c + 1] - first;
+
+        if (c == RBMAXCOLORS || n < RBMINBATCHSIZE)
+        {
+            for (int i = first; i < first + n; ++i) f(order[i]);
+        }
+        else
+        {
+            threadPool.parallelFor(n, [&](const int &begin, const int &end, const int &)
+            {
+                for (int i = first + begin; i < first + end; ++i) f(order[i]);
+            });
+        }
+    }
+}
+
+int RigidBodySystem::findPair(const int &i1, const int &i2) const noexcept
+{
+    //Find the index of the pair of bodies i1 and i2, or return -1 if their bounding boxes do not overlap.
+    const auto [j1, j2] = std::minmax(i1, i2);
+    const RigidBodyPair key = {j1, j2, false, 0.0f};
+    const auto ptr = std::lower_bound(pairs.begin(), pairs.end(), key);
+
+    if (ptr == pairs.end() || ptr->i1 != j1 || ptr->i2 != j2) return -1;
+
+    return ptr - pairs.begin();
+}
+
+void RigidBodySystem::updatePairs()
+{
+    //Update the persistent set of overlapping pairs for all bodies that have been reinserted into the broad phase.
+    //Pairs between bodies that did not move cannot have changed.
+    if (movedBodies.empty()) return;
+
+    bodyMoved.assign(bodies.size(), false);
+
+    for (const auto &i : movedBodies)
+    {
+        bodyMoved[i] = true;
+    }
+
+    //Remove pairs of which the bounding boxes no longer overlap.
+    pairs.erase(std::remove_if(pairs.begin(), pairs.end(), [&](const RigidBodyPair &p)
+    {
+        return (bodyMoved[p.i1] || bodyMoved[p.i2]) &&
+               (!bodyInBroadPhase[p.i1] || !bodyInBroadPhase[p.i2] || !overlapping(getBroadPhaseBox(p.i1), getBroadPhaseBox(p.i2)));
+    }), pairs.end());
+
+    //Find new pairs for the moved bodies, counting pairs of two moved bodies only once.
+    newPairs.clear();
+
+    const auto addNewPair = [&](const int &i, const int &j)
+    {
+        const auto [j1, j2] = std::minmax(i, j);
+
+        if (findPair(j1, j2) < 0)
+        {
+            newPairs.push_back({j1, j2, nonCollidingBodies.count((static_cast<uint64_t>(j1) << 32) | static_cast<uint64_t>(j2)) != 0, 0.0f});
+        }
+    };
+
+    if (broadPhaseType == RigidBodyBroadPhase::Tree &&
+        static_cast<float>(movedBodies.size()) >= RBPAIRTRAVERSALFRACTION*static_cast<float>(tree.size() + staticTree.size()))
+    {
+        //When many bodies moved, descending the trees simultaneously is cheaper than a query per body.
+        //This finds the same pairs: all movable pairs and all movable-immovable pairs with a moved body.
+        overlappingPairs.clear();
+        tree.getOverlappingContents(overlappingPairs);
+        tree.getOverlappingContents(staticTree, overlappingPairs);
+
+        for (const auto &p : overlappingPairs)
+        {
+            if (bodyMoved[p.first] || bodyMoved[p.second]) addNewPair(p.first, p.second);
+        }
+    }
+    else
+    {
+        for (const auto &i : movedBodies)
+        {
+            if (!bodyInBroadPhase[i]) continue;
+
+            //Pairs of immovable bodies are never needed, so those only look for movable bodies.
+            overlappingBodies.clear();
+
+            if (bodyInStaticTree[i]) broadPhase->getOverlappingContents(staticTree.getNodeBox(i), overlappingBodies);
+            else getBroadPhaseOverlaps(broadPhase->getNodeBox(i), overlappingBodies);
+
+            for (const auto &j : overlappingBodies)
+            {
+                if (j == i || (bodyMoved[j] && j < i)) continue;
+
+                addNewPair(i, j);
+            }
+        }
+    }
+
+    movedBodies.clear();
+
+    //Merge new pairs into the sorted existing ones.
+    std::sort(newPairs.begin(), newPairs.end());
+    newPairs.erase(std::unique(newPairs.begin(), newPairs.end(), [](const RigidBodyPair &a, const RigidBodyPair &b)
+    {
+        return a.i1 == b.i1 && a.i2 == b.i2;
+    }), newPairs.end());
+
+    mergedPairs.clear();
+    std::merge(pairs.begin(), pairs.end(), newPairs.begin(), newPairs.end(), std::back_inserter(mergedPairs));
+    pairs.swap(mergedPairs);
+}
+
+void RigidBodySystem::gatherCollisionTriangles(const int &i)
+{
+    //Gather triangles from the user on this thread, such that getCollisionTriangles() need not be thread-safe.
+    const RigidBody &b = bodies[i];
+    const int first = collisionTriangles.size();
+
+    if (b.canCollide && !b.asleep && layersCanCollide(i, 0))
+    {
+        const auto triangles = getCollisionTriangles(b);
+
+        collisionTriangles.insert(collisionTriangles.end(), triangles.begin(), triangles.begin() + 3*(triangles.size()/3));
+    }
+
+    collisionTriangleRanges[i] = {first, static_cast<int>(collisionTriangles.size())};
+}
+
+template <typename PairFunction, typename BodyFunction>
+void RigidBodySystem::findCollisionsInParallel(const int &nrPairs, const int &nrBodies, const PairFunction &getPair, const BodyFunction &getBody, std::vector<RigidBodyCollision> &collisions)
+{
+    //Append all collisions of pairs getPair(0), ..., getPair(nrPairs - 1) and of bodies getBody(0), ..., getBody(nrBodies - 1) with triangles and static colliders.
+    //Each thread writes to its own buffer.
+    threadCollisions.resize(threadPool.getNrThreads());
+    threadTriangles.resize(threadPool.getNrThreads());
+
+    for (auto &tc : threadCollisions)
+    {
+        tc.clear();
+    }
+
+    threadPool.parallelFor(nrPairs + nrBodies, [&](const int &first, const int &last, const int &thread)
+    {
+        auto &out = threadCollisions[thread];
+
+        for (int i = first; i < last; ++i)
+        {
+            if (i < nrPairs)
+            {
+                const RigidBodyPair &p = pairs[getPair(i)];
+
+                //Are collisions allowed between these bodies and is at least one of them active?
+                //Bodies that cannot collide at all are not part of the broad phase.
+                if (!p.nonColliding && layersCanCollide(p.i1, p.i2) && (isActive(p.i1) || isActive(p.i2)))
+                {
+                    findSphereCollisions(p.i1, p.i2, out);
+                }
+            }
+            else
+            {
+                findTriangleCollisions(getBody(i - nrPairs), out, threadTriangles[thread]);
+            }
+        }
+    });
+
+    //Merge in thread order, which yields the same order as a serial run.
+    size_t nrCollisions = collisions.size();
+
+    for (const auto &tc : threadCollisions)
+    {
+        nrCollisions += tc.size();
+    }
+
+    collisions.reserve(nrCollisions);
+
+    for (const auto &tc : threadCollisions)
+    {
+        collisions.insert(collisions.end(), tc.begin(), tc.end());
+    }
+}
+
+void RigidBodySystem::findCollisions(const float &dt, std::vector<RigidBodyCollision> &collisions)
+{
+    updateCollisionSpheres(dt);
+
+    const int nrBodies = bodies.size();
+
+    collisionTriangles.clear();
+    collisionTriangleRanges.resize(nrBodies);
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        gatherCollisionTriangles(i);
+    }
+
+    //Find all collision points.
+    const auto identity = [](const int &i)
+    {
+        return i;
+    };
+
+    collisions.clear();
+    findCollisionsInParallel(pairs.size(), nrBodies, identity, identity, collisions);
+}
+
+void RigidBodySystem::findWokenBodyCollisions(std::vector<RigidBodyCollision> &collisions)
+{
+    //Append the collisions of bodies that have just been woken by wakeTouchedIslands(), which were skipped while they were asleep.
+    //Pairs with a body that was already active and triangles of bodies that were already active have been checked before.
+    //The collision spheres of woken bodies are still valid, since sleeping bodies do not move.
+    for (const auto &i : wokenBodies)
+    {
+        gatherCollisionTriangles(i);
+    }
+
+    wokenPairs.clear();
+
+    for (int i = 0; i < static_cast<int>(pairs.size()); ++i)
+    {
+        const RigidBodyPair &p = pairs[i];
+        const bool wasActive = (bodies[p.i1].movable && !bodyWasAsleep[p.i1]) || (bodies[p.i2].movable && !bodyWasAsleep[p.i2]);
+
+        if (!wasActive && (isActive(p.i1) || isActive(p.i2))) wokenPairs.push_back(i);
+    }
+
+    findCollisionsInParallel(wokenPairs.size(), wokenBodies.size(), [&](const int &i)
+    {
+        return wokenPairs[i];
+    }, [&](const int &i)
+    {
+        return wokenBodies[i];
+    }, collisions);
+}
+
+void RigidBodySystem::findFastBodyCollisions(const std::vector<RigidBodyCollision> &collisions, const float &h)
+{
+    //Find collisions of active bodies that can move further than a fraction of their smallest internal sphere in a single substep.
+    const int nrBodies = bodies.size();
+
+    fastBodies.assign(nrBodies, false);
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        const RigidBody &b = bodies[i];
+
+        if (!isActive(i)) continue;
+
+        float r = b.radius;
+
+        for (int j = b.firstInternalSphere; j < b.lastInternalSphere; ++j)
+        {
+            r = std::min(r, bodyInternalSpheres[j].w);
+        }
+
+        fastBodies[i] = (h*length(b.v) > RBTOIFRACTION*r);
+    }
+
+    fastBodyCollisions.clear();
+
+    for (int i = 0; i < static_cast<int>(collisions.size()); ++i)
+    {
+        if (fastBodies[collisions[i].b1.i]) fastBodyCollisions.push_back({collisions[i].b1.i, i});
+        if (fastBodies[collisions[i].b2.i]) fastBodyCollisions.push_back({collisions[i].b2.i, i});
+    }
+
+    std::sort(fastBodyCollisions.begin(), fastBodyCollisions.end());
+}
+
+void RigidBodySystem::clampTimeOfImpact(const std::vector<RigidBodyCollision> &collisions)
+{
+    //Move fast bodies back along their path of the current substep, such that no speculative contact penetrates deeper than a fraction of its sphere.
+    //This is a conservative advancement of the translation only, the remainder of the substep's motion is lost.
+    for (size_t j = 0; j < fastBodyCollisions.size(); )
+    {
+        const int i = fastBodyCollisions[j].first;
+        float s = 1.0f;
+
+        for ( ; j < fastBodyCollisions.size() && fastBodyCollisions[j].first == i; ++j)
+        {
+            const RigidBodyCollision c = initializeCollision(collisions[fastBodyCollisions[j].second]);
+            float r = bodyInternalSpheres[bodies[c.b1.i].firstInternalSphere + c.b1.sphere].w;
+
+            if (c.b2.i > 0) r = std::min(r, bodyInternalSpheres[bodies[c.b2.i].firstInternalSphere + c.b2.sphere].w);
+
+            const float closing = dot((bodies[c.b1.i].x - preStates[c.b1.i].x) - (bodies[c.b2.i].x - preStates[c.b2.i].x), c.n);
+
+            if (c.d < -RBTOIFRACTION*r && closing > 0.0f)
+            {
+                s = std::min(s, std::max(0.0f, 1.0f + (c.d + RBTOIFRACTION*r)/closing));
+            }
+        }
+
+        if (s < 1.0f && isActive(i))
+        {
+            bodies[i].x = preStates[i].x + s*(bodies[i].x - preStates[i].x);
+        }
+    }
+}
+
+bool RigidBodySystem::wakeTouchedIslands(const std::vector<RigidBodyCollision> &collisions)
+{
+    //Wake up sleeping bodies that are constrained to, or may collide with, an active body, and list them in wokenBodies.
+    const int nrBodies = bodies.size();
+    bool wokeUp = false;
+
+    bodyWasAsleep.resize(nrBodies);
+
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        bodyWasAsleep[i] = bodies[i].asleep;
+    }
+
+    const auto wake = [&](const int &i1, const int &i2)
+    {
+        if (bodies[i1].asleep && isActive(i2))
+        {
+            wakeIsland(i1);
+            wokeUp = true;
+        }
+    };
+
+    for (const auto &c : constraints)
+    {
+        wake(c.b1.i, c.b2.i);
+        wake(c.b2.i, c.b1.i);
+    }
+
+    for (const auto &c : collisions)
+    {
+        wake(c.b1.i, c.b2.i);
+        wake(c.b2.i, c.b1.i);
+    }
+
+    wokenBodies.clear();
+
+    if (wokeUp)
+    {
+        for (int i = 0; i < nrBodies; ++i)
+        {
+            if (bodyWasAsleep[i] && !bodies[i].asleep) wokenBodies.push_back(i);
+        }
+    }
+
+    return wokeUp;
+}
+
+void RigidBodySystem::update(const float &dt)
+{
+    //Per Detailed Rigid Body Simulation with Extended Position Based Dynamics by Matthias Muller et al., ACM SIGGRAPH, vol. 39, nr. 8, 2020.
+    
+    //Only query the clock if statistics are requested.
+    const auto getClock = [this]()
+    {
+        return (statisticsEnabled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point());
+    };
+    const auto start = getClock();
+    auto clock = start;
+    
+    //Get time in milliseconds since the previous call.
+    const auto getLapTime = [&]()
+    {
+        const auto end = getClock();
+        const double t = std::chrono::duration<double, std::milli>(end - clock).count();
 
-    //FIXME: For proper momentum conservation we should have this:
-    //const vec3 r1 = p - b1->x;
-    //const vec3 r2 = p - b2->x;
-    const float w1 = b1->invM + dot(cross(r1, n), b1->getInvI()*cross(r1, n));
-    const float w2 = b2->invM + dot(cross(r2, n), b2->getInvI()*cross(r2, n));
+        clock = end;
+
+        return t;
+    };
+
+    //Wake up bodies that have been disturbed since the previous update.
+    if (sleepingEnabled)
+    {
+        wakeDisturbedBodies();
+    }
+
+    //Detect all collision pairs for the current state.
+
+    //Check whether bounding boxes still contain objects in their current state and update the broad phase if not.
+    int nrReinserts = 0;
+
+    updateBroadPhaseMembership();
+
+    for (size_t i = 1; i < bodies.size(); ++i)
+    {
+        const RigidBody &b = bodies[i];
+
+        if (!bodyInBroadPhase[i]) continue;
+
+        //Immovable bodies may still be moved by the user (e.g., doors or platforms), in which case their tight box is refitted.
+        if (bodyInStaticTree[i])
+        {
+            const aabb::aabb box = b.getAABB(0.0f);
+
+            if (!box.isSubsetOf(staticTree.getNodeBox(i)))
+            {
+                staticTree.erase(i);
+                staticTree.insert(box, i);
+                movedBodies.push_back(i);
+                ++nrReinserts;
+            }
+
+            continue;
+        }
+
+        //Sleeping bodies do not move, so their boxes remain valid.
+        if (b.asleep) continue;
+
+        if (!b.getAABB(dt).isSubsetOf(broadPhase->getNodeBox(i)))
+        {
+            broadPhase->erase(i);
+            broadPhase->insert(b.getAABB(RBAABBDT).scale(RBAABBSCALE), i);
+            movedBodies.push_back(i);
+            ++nrReinserts;
+        }
+    }
+
+#ifndef NDEBUG
+    broadPhase->check();
+    staticTree.check();
+#endif
+
+    //Check which objects can potentially intersect.
+    updatePairs();
+
+    if (statisticsEnabled)
+    {
+        statistics.nrReinserts = nrReinserts;
+        statistics.nrPairs = pairs.size();
+        statistics.broadPhaseTime = getLapTime();
+    }
+
+    //Find all potential collisions.
+    std::vector<RigidBodyCollision> collisions;
+
+    findCollisions(dt, collisions);
+
+    //Wake up sleeping bodies that may be hit by an active body and only find the collisions of the bodies that were woken.
+    while (sleepingEnabled && wakeTouchedIslands(collisions))
+    {
+        findWokenBodyCollisions(collisions);
+    }
+
+    if (statisticsEnabled)
+    {
+        statistics.nrContacts = collisions.size();
+        statistics.narrowPhaseTime = getLapTime();
+    }
+
+    const int nrBodies = bodies.size();
+
+    //Partition collisions and constraints into batches that do not share any bodies, such that each batch can be solved in parallel.
+    //Shuffle collisions first to avoid a systematic bias in the solver.
+    //This is a Fisher-Yates shuffle drawing directly from the generator, since std::shuffle differs between standard libraries.
+    for (int i = static_cast<int>(collisions.size()) - 1; i > 0; --i)
+    {
+        std::swap(collisions[i], collisions[static_cast<uint32_t>(random()) % static_cast<uint32_t>(i + 1)]);
+    }
+
+    batchBodyPairs.clear();
+
+    for (const auto &c : collisions)
+    {
+        batchBodyPairs.push_back({c.b1.i, c.b2.i});
+    }
+
+    colorConstraintGraph(batchBodyPairs, collisionBatchOrder, collisionBatchOffsets);
+    batchBodyPairs.clear();
+
+    for (const auto &c : constraints)
+    {
+        batchBodyPairs.push_back({c.b1.i, c.b2.i});
+    }
+
+    colorConstraintGraph(batchBodyPairs, constraintBatchOrder, constraintBatchOffsets);
+    
+    if (statisticsEnabled)
+    {
+        statistics.batchTime = getLapTime();
+    }
+
+    //Solve positions, adapting the number of substeps to the error left by the previous update if requested.
+    if (adaptiveSubStepsEnabled)
+    {
+        if (constraintError > constraintTolerance)
+        {
+            //The error of a substep scales quadratically with its duration.
+            const int n = static_cast<int>(std::ceil(static_cast<float>(nrCurrentSubSteps)*std::sqrt(constraintError/constraintTolerance)));
+
+            nrCurrentSubSteps = std::min(maxNrSubSteps, std::max(nrCurrentSubSteps + 1, n));
+        }
+        else if (constraintError < 0.25f*constraintTolerance)
+        {
+            nrCurrentSubSteps = std::max(minNrSubSteps, nrCurrentSubSteps - 1);
+        }
+    }
+
+    const float h = dt/static_cast<float>(nrCurrentSubSteps);
+
+    //Warm starting data is stored per unit of squared substep time, such that it remains valid if the time step changes.
+    const auto getWarmStart = [](const RigidBodyCollision &c, const float &lambda)
+    {
+        return RigidBodyWarmStart{c.b1.i, c.b1.sphere, c.b2.i, c.b2.sphere, (c.b2.i == 0 ? (1.0f/3.0f)*(c.t[0] + c.t[1] + c.t[2]) : vec3(0.0f)), lambda};
+    };
+
+    if (warmStartingEnabled)
+    {
+        for (auto &c : collisions)
+        {
+            const RigidBodyWarmStart w = getWarmStart(c, 0.0f);
+            const auto ptr = std::lower_bound(warmStarts.begin(), warmStarts.end(), w);
+
+            if (ptr != warmStarts.end() && !(w < *ptr)) c.warmStart = (h*h)*ptr->lambda;
+        }
+
+        for (auto &c : constraints)
+        {
+            c.correction *= h*h;
+        }
+    }
+
+    if (speculativeContactsEnabled)
+    {
+        findFastBodyCollisions(collisions, h);
+    }
+
+    if (statisticsEnabled)
+    {
+        statistics.subStepTimes.assign(nrCurrentSubSteps, 0.0);
+        statistics.nrViolatedConstraints.assign(nrCurrentSubSteps, 0);
+    }
+
+    for (int iSubStep = 0; iSubStep < nrCurrentSubSteps; ++iSubStep)
+    {
+        //Apply forces.
+        for (auto &b : bodies)
+        {
+            b.f = vec3(0.0f);
+            b.t = vec3(0.0f);
+        }
+
+        applyExternalForces();
+
+        //Initialize non-collision constraints.
+        for (auto &c : constraints)
+        {
+            c.lambda = 0.0f;
+            c.forceToZero = false;
+            c.correction = (warmStartingEnabled ? warmStartFactor*c.correction : vec3(0.0f));
+        }
+
+        //Store pre-update positions and velocities.
+        preStates.resize(nrBodies);
+
+        for (int i = 0; i < nrBodies; ++i)
+        {
+            const RigidBody &b = bodies[i];
+
+            preStates[i] = {b.x, b.q, b.v, b.w, mat3::rotationMatrix(b.q)};
+        }
+
+        //Apply forces and velocities.
+        for (auto &b : bodies)
+        {
+            if (b.movable && !b.asleep)
+            {
+                b.v += (h*b.invM)*b.f;
+                b.x += h*b.v;
+            }
+        }
+
+        for (auto &b : bodies)
+        {
+            if (b.movable && !b.asleep)
+            {
+                //Evaluate the gyroscopic term in body coordinates, where the inertia tensor is diagonal.
+                //This requires a single rotation matrix instead of the four used by getI() and getInvI().
+                const mat3 R = mat3::rotationMatrix(b.q);
+                const mat3 Rt = R.transposed();
+                const vec3 w = Rt*b.w;
+
+                b.w += h*(R*(b.invI*(Rt*b.t - cross(w, w/b.invI))));
+                b.q += (0.5f*h)*quatmul(vec4(b.w, 0.0f), b.q);
+                b.q = normalize(b.q);
+            }
+        }
+
+        updateTransforms();
+
+        if (speculativeContactsEnabled)
+        {
+            clampTimeOfImpact(collisions);
+        }
+
+        //Solve positions.
+        
+        //Collisions.
+        for (auto &c : collisions)
+        {
+            c.lambda = 0.0f;
+            c.warmStart = (warmStartingEnabled ? warmStartFactor*c.warmStart : 0.0f);
+        }
+
+        solveBatches(collisionBatchOrder, collisionBatchOffsets, [&](const int &i)
+        {
+            solveCollisionPosition(collisions[i], h);
+        });
+
+        //Apply position constraints.
+        solveBatches(constraintBatchOrder, constraintBatchOffsets, [&](const int &i)
+        {
+            solveConstraintPosition(constraints[i], h);
+        });
+        
+        //Bring the transforms of bodies corrected by the position solve up to date for the velocity solve.
+        for (int i = 0; i < nrBodies; ++i)
+        {
+            refreshTransform(&bodies[i], &transforms[i]);
+        }
+
+        //Update velocities.
+        for (int i = 0; i < nrBodies; ++i)
+        {
+            if (isActive(i))
+            {
+                bodies[i].v = (bodies[i].x - preStates[i].x)/h;
+
+                const vec4 dq = quatmul(bodies[i].q, quatconj(preStates[i].q));
+
+                bodies[i].w = (dq.w >= 0.0f ? 2.0f/h : -2.0f/h)*dq.xyz();
+            }
+        }
+
+        //Solve velocities.
+
+        //Velocity update for position constraints.
+        solveBatches(constraintBatchOrder, constraintBatchOffsets, [&](const int &i)
+        {
+            solveConstraintVelocity(constraints[i]);
+        });
+
+        //Velocity update for collisions.
+        solveBatches(collisionBatchOrder, collisionBatchOffsets, [&](const int &i)
+        {
+            solveCollisionVelocity(collisions[i], h);
+        });
+
+        if (statisticsEnabled)
+        {
+            int nrViolated = 0;
+
+            for (const auto &c : collisions) nrViolated += c.forceToZero;
+            for (const auto &c : constraints) nrViolated += c.forceToZero;
+
+            statistics.nrViolatedConstraints[iSubStep] = nrViolated;
+            statistics.subStepTimes[iSubStep] = getLapTime();
+        }
+    }
+
+    //Store collision constraint multipliers with their pairs for the next update.
+    for (auto &p : pairs)
+    {
+        p.lambda = 0.0f;
+    }
+
+    for (const auto &c : collisions)
+    {
+        if (c.b2.i != 0)
+        {
+            const int p = findPair(c.b1.i, c.b2.i);
 
-    n *= -length(dv)/(w1 + w2);
+            assert(p >= 0);
+            pairs[p].lambda += c.lambda;
+        }
+    }
 
-    b1->v += b1->invM*n;
-    b1->w += b1->getInvI()*cross(r1, n);
-    
-    b2->v -= b2->invM*n;
-    b2->w -= b2->getInvI()*cross(r2, n);
-}
+    //Measure the remaining error to choose the number of substeps of the next update.
+    if (adaptiveSubStepsEnabled)
+    {
+        constraintError = getConstraintError(collisions);
+        if (statisticsEnabled) statistics.constraintError = constraintError;
+    }
 
-RigidBodyCollision RigidBodySystem::initializeCollision(RigidBodyCollision c) const noexcept
-{
-    //Evaluate for currently active body states.
-    const RigidBody *b1 = &bodies[c.b1.i];
-    const RigidBody *b2 = &bodies[c.b2.i];
+    //Store multipliers to warm start the next update.
+    warmStarts.clear();
 
-    vec4 is;
-    vec3 n, p1, p2;
-    float d;
-    
-    if (c.b1.i > 0 && c.b2.i > 0)
+    if (warmStartingEnabled)
     {
-        //Get potentially colliding internal spheres.
-        is = bodyInternalSpheres[b1->firstInternalSphere + c.b1.sphere];
-        const vec4 s1 = vec4(b1->x + mat3::rotationMatrix(b1->q)*is.xyz(), is.w);
-        is = bodyInternalSpheres[b2->firstInternalSphere + c.b2.sphere];
-        const vec4 s2 = vec4(b2->x + mat3::rotationMatrix(b2->q)*is.xyz(), is.w);
+        for (const auto &c : collisions)
+        {
+            if (c.warmStart != 0.0f) warmStarts.push_back(getWarmStart(c, c.warmStart/(h*h)));
+        }
 
-        n = normalize(s2.xyz() - s1.xyz());
-        p1 = s1.xyz() + s1.w*n;
-        p2 = s2.xyz() - s2.w*n;
-        d = dot(s2.xyz() - s1.xyz(), n) - s1.w - s2.w;
+        std::sort(warmStarts.begin(), warmStarts.end());
+
+        for (auto &c : constraints)
+        {
+            c.correction *= 1.0f/(h*h);
+        }
     }
-    else
-    {
-        //Case where we have a rigid body colliding with the triangle mesh.
-        assert(c.b1.i > 0 && c.b2.i == 0);
 
-        is = bodyInternalSpheres[b1->firstInternalSphere + c.b1.sphere];
-        const vec4 s1 = vec4(b1->x + mat3::rotationMatrix(b1->q)*is.xyz(), is.w);
-        p2 = getClosestPointOnTriangle(s1.xyz(), c.t);
-        
-        n = normalize(p2 - s1.xyz());
-        p1 = s1.xyz() + s1.w*n;
-        d = dot(p2 - s1.xyz(), n) - s1.w;
+    //Deactivate islands of bodies that have come to rest.
+    if (sleepingEnabled)
+    {
+        updateSleepingBodies(dt, collisions);
     }
 
-    c.b1.r = mat3::rotationMatrix(quatconj(b1->q))*(p1 - b1->x);
-    c.b2.r = mat3::rotationMatrix(quatconj(b2->q))*(p2 - b2->x);
-    c.d = d;
-    c.n = n;
+    //Calculate total energy and momenta.
+    totalEnergy = 0.0f;
+    totalLinearMomentum = vec3(0.0f);
+    totalAngularMomentum = vec3(0.0f);
+    
+    for (const auto &b : bodies)
+    {
+        if (b.movable)
+        {
+            //Angular velocity and momentum in body coordinates.
+            const mat3 R = mat3::rotationMatrix(b.q);
+            const vec3 w = R.transposed()*b.w;
+            const vec3 L = w/b.invI;
 
-    return c;
+            totalEnergy += (0.5f/b.invM)*length2(b.v) + 0.5f*dot(w, L);
+            totalLinearMomentum += (1.0f/b.invM)*b.v;
+            totalAngularMomentum += (1.0f/b.invM)*cross(b.x, b.v) + R*L;
+        }
+    }
+
+    totalEnergy += potentialEnergy();
+    
+    //Increment global time.
+    time += dt;
+    if (statisticsEnabled)
+    {
+        statistics.totalTime = std::chrono::duration<double, std::milli>(getClock() - start).count();
+    }
 }
 
-TwoRigidBodyPointGeometry RigidBodySystem::getWorldGeometry(const std::vector<RigidBody> &bodies, const PointOnRigidBody &b1, const PointOnRigidBody &b2) noexcept
+void RigidBodySystem::updateTransforms() noexcept
 {
-    const RigidBody *pb1 = &bodies[b1.i];
-    const RigidBody *pb2 = &bodies[b2.i];
-    const vec3 r1 = mat3::rotationMatrix(pb1->q)*b1.r;
-    const vec3 r2 = mat3::rotationMatrix(pb2->q)*b2.r;
+    //Evaluate rotation matrices and world inverse inertia tensors once per substep, the solver keeps them up to date afterwards.
+    const int nrBodies = bodies.size();
 
-    return TwoRigidBodyPointGeometry({pb1->x + r1,
-                                       pb2->x + r2,
-                                       pb1->v + cross(pb1->w, r1),
-                                       pb2->v + cross(pb2->w, r2)});
-}
+    transforms.resize(nrBodies);
 
-aabb::aabb RigidBody::getAABB(const float &dt) const noexcept
-{
-    //Determine AABB with margin.
-    const float r = radius + 0.5f*dt*dt*RBMAXACC + RBEPS;
-    
-    return aabb::aabb{x - vec3(r) + min(vec3(0.0f), dt*v), x + vec3(r) + max(vec3(0.0f), dt*v)};
+    for (int i = 0; i < nrBodies; ++i)
+    {
+        updateTransform(&bodies[i], &transforms[i]);
+    }
 }
 
-void RigidBodySystem::update(const float &dt)
+void RigidBodySystem::updateCollisionSpheres(const float &dt)
 {
-    //Per Detailed Rigid Body Simulation with Extended Position Based Dynamics by Matthias Muller et al., ACM SIGGRAPH, vol. 39, nr. 8, 2020.
+    //Transform all internal spheres to world space once and add margins for the object's velocity (linear and angular).
+    //Each body gets a multiple of RBSPHEREWIDTH entries, where padding spheres have a negative radius such that they never collide.
+    const int nrBodies = bodies.size();
 
-    //Detect all collision pairs for the current state.
+    collisionSphereOffsets.resize(nrBodies + 1);
+    collisionSphereOffsets[0] = 0;
 
-    //Check whether bounding boxes still contain objects in their current state and update AABB tree if not.
-    for (size_t i = 1; i < bodies.size(); ++i)
+    for (int i = 0; i < nrBodies; ++i)
     {
-        const RigidBody &b = bodies[i];
+        const int n = bodies[i].lastInternalSphere - bodies[i].firstInternalSphere;
 
-        if (!b.getAABB(dt).isSubsetOf(tree.getNodeBox(i)))
-        {
-            tree.erase(i);
-            tree.insert(b.getAABB(RBAABBDT).scale(RBAABBSCALE), i);
-        }
+        collisionSphereOffsets[i + 1] = collisionSphereOffsets[i] + RBSPHEREWIDTH*((n + RBSPHEREWIDTH - 1)/RBSPHEREWIDTH);
     }
 
-#ifndef NDEBUG
-    tree.check();
-#endif
+    const int nrSpheres = collisionSphereOffsets[nrBodies];
 
-    //Check which objects can potentially intersect.
-    const auto intersectingObjects = tree.getOverlappingContents();
-    std::vector<RigidBodyCollision> collisions;
+    collisionSphereX.assign(nrSpheres, 0.0f);
+    collisionSphereY.assign(nrSpheres, 0.0f);
+    collisionSphereZ.assign(nrSpheres, 0.0f);
+    collisionSphereR.assign(nrSpheres, -1.0e30f);
+    sphereTreeSpheres.resize(sphereTreeNodes.size());
 
-    //Find all collision points between potentially intersecting Spheres objects.
-    //Use simple n^2 comparison (assume small number of internal spheres per object).
-    for (const auto &intersection : intersectingObjects)
+    threadPool.parallelFor(nrBodies, [&](const int &first, const int &last, const int &)
     {
-        //Are collisions allowed between these bodies?
-        if (nonCollidingBodies.find(intersection) == nonCollidingBodies.end())
+        for (int i = first; i < last; ++i)
         {
-            const RigidBody &b1 = bodies[intersection.first];
-            const RigidBody &b2 = bodies[intersection.second];
+            const RigidBody &b = bodies[i];
+            const mat3 R = mat3::rotationMatrix(b.q);
+            int j = collisionSphereOffsets[i];
+
+            for (auto iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS, ++j)
+            {
+                const vec3 p = b.x + R*bodyInternalSpheres[iS].xyz();
 
-            //TODO: Use that we could be testing 1 body vs. many other bodies to optimize.
-            //TODO: Consider enforcing a fixed number of internal spheres per object to parallellize these checks effectively.
-            //TODO: Objects that cannot collide should not be part of the tree in the first place.
-            if (b1.canCollide && b2.canCollide) {
-                const mat3 R1 = mat3::rotationMatrix(b1.q);
-                const mat3 R2 = mat3::rotationMatrix(b2.q);
+                collisionSphereX[j] = p.x;
+                collisionSphereY[j] = p.y;
+                collisionSphereZ[j] = p.z;
+                collisionSphereR[j] = bodyInternalSpheres[iS].w + (dt*(0.5f*dt*RBMAXACC + length(b.v + cross(b.w, p - b.x))) + RBEPS);
+            }
 
-                for (auto iS1 = b1.firstInternalSphere; iS1 < b1.lastInternalSphere; ++iS1)
-                {
-                    //Get potential collisions taking the object's velocity (linear and angular) into account.
-                    vec4 s1 = vec4(b1.x + R1*bodyInternalSpheres[iS1].xyz(), bodyInternalSpheres[iS1].w);
+            //The margin of a node bounds the margins of all spheres inside it, since their velocities differ by at most |w| times the node's radius.
+            for (int k = sphereTreeRanges[i].first; k < sphereTreeRanges[i].last; ++k)
+            {
+                const vec4 s = sphereTreeNodes[k].s;
+                const vec3 p = b.x + R*s.xyz();
 
-                    s1.w += dt*(0.5f*dt*RBMAXACC + length(b1.v + cross(b1.w, s1.xyz() - b1.x))) + RBEPS;
-                    
-                    for (auto iS2 = b2.firstInternalSphere; iS2 < b2.lastInternalSphere; ++iS2)
-                    {
-                        vec4 s2 = vec4(b2.x + R2*bodyInternalSpheres[iS2].xyz(), bodyInternalSpheres[iS2].w);
-
-                        s2.w += dt*(0.5f*dt*RBMAXACC + length(b2.v + cross(b2.w, s2.xyz() - b2.x))) + RBEPS;
-                        
-                        if (length(s1.xyz() - s2.xyz()) <= s1.w + s2.w)
-                        {
-                            //If so, add a potential collision.
-                            collisions.push_back(RigidBodyCollision({{intersection.first, iS1 - b1.firstInternalSphere, vec3(0.0f)},
-                                                                     {intersection.second, iS2 - b2.firstInternalSphere, vec3(0.0f)},
-                                                                     0.0f, vec3(0.0f), {vec3(0.0f), vec3(0.0f), vec3(0.0f)}, 0.0f, false}));
-                        }
-                    }
-                }
+                sphereTreeSpheres[k] = vec4(p, RBOPEPS*(s.w + dt*(0.5f*dt*RBMAXACC + length(b.v + cross(b.w, p - b.x)) + length(b.w)*s.w) + RBEPS));
             }
         }
+    });
+}
+
+int RigidBodySystem::buildSphereTree(const std::vector<vec4> &spheres, const int &first, const int &last, const int &depth)
+{
+    //Recursively split the internal spheres in sphereTreeIndices[first, last) at the median along the longest axis.
+    //Median splits keep the hierarchy balanced, but the depth is capped regardless, such that traversals never exceed their fixed stack.
+    const int index = sphereTreeNodes.size();
+    vec3 lo = spheres[sphereTreeIndices[first]].xyz();
+    vec3 hi = lo;
+
+    for (int i = first; i < last; ++i)
+    {
+        lo = min(lo, spheres[sphereTreeIndices[i]].xyz());
+        hi = max(hi, spheres[sphereTreeIndices[i]].xyz());
+    }
+
+    const vec3 c = 0.5f*(lo + hi);
+    float r = 0.0f;
+
+    for (int i = first; i < last; ++i)
+    {
+        const vec4 s = spheres[sphereTreeIndices[i]];
+
+        r = std::max(r, length(s.xyz() - c) + s.w);
     }
 
-    //Find all potential collisions between Spheres and triangles.
-    for (int iB = 0; iB < static_cast<int>(bodies.size()); ++iB)
+    sphereTreeNodes.push_back({vec4(c, r), first, last, -1, -1});
+
+    if (last - first > RBSPHERELEAFSIZE && depth < RBSPHERETREEDEPTH)
     {
-        const RigidBody &b = bodies[iB];
+        const vec3 e = hi - lo;
+        const int axis = (e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2));
+        const int mid = (first + last)/2;
 
-        if (b.canCollide)
+        std::nth_element(sphereTreeIndices.begin() + first, sphereTreeIndices.begin() + mid, sphereTreeIndices.begin() + last, [&](const int &a, const int &b)
         {
-            const auto triangles = getCollisionTriangles(b);
+            const vec4 sa = spheres[a];
+            const vec4 sb = spheres[b];
 
-            for (int i = 0; i < static_cast<int>(triangles.size()) - 2; i += 3)
-            {
-                const std::array<vec3, 3> t = {{triangles[i], triangles[i + 1], triangles[i + 2]}};
+            return (axis == 0 ? sa.x < sb.x : (axis == 1 ? sa.y < sb.y : sa.z < sb.z));
+        });
 
-                //Can the body intersect with the triangle?
-                if (length(b.x - getClosestPointOnTriangle(b.x, t)) <= b.collisionRadius)
-                {
-                    const mat3 R = mat3::rotationMatrix(b.q);
+        const int left = buildSphereTree(spheres, first, mid, depth + 1);
+        const int right = buildSphereTree(spheres, mid, last, depth + 1);
 
-                    for (auto iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
-                    {
-                        //Get potential collisions taking the object's velocity (linear and angular) into account.
-                        vec4 s = vec4(b.x + R*bodyInternalSpheres[iS].xyz(), bodyInternalSpheres[iS].w);
-
-                        s.w += dt*(0.5f*dt*RBMAXACC + length(b.v + cross(b.w, s.xyz() - b.x))) + RBEPS;
-
-                        const vec3 p = getClosestPointOnTriangle(s.xyz(), t);
-                        
-                        if (length(p - s.xyz()) <= s.w)
-                        {
-                            //If so, add a potential collision.
-                            collisions.push_back(RigidBodyCollision({{iB, iS - b.firstInternalSphere, vec3(0.0f)},
-                                                                    {0, 0, vec3(0.0f)},
-                                                                    0.0f, vec3(0.0f), t, 0.0f, false}));
-                        }
-                    }
-                }
-            }
-        }
+        sphereTreeNodes[index].left = left;
+        sphereTreeNodes[index].right = right;
     }
-    
-    //Solve positions.
-    const float h = dt/static_cast<float>(nrSubSteps);
 
-    for (int iSubStep = 0; iSubStep < nrSubSteps; ++iSubStep)
+    return index;
+}
+
+vec4 RigidBodySystem::getCollisionSphere(const int &iB, const int &iS) const noexcept
+{
+    const int j = collisionSphereOffsets[iB] + iS;
+
+    return vec4(collisionSphereX[j], collisionSphereY[j], collisionSphereZ[j], collisionSphereR[j]);
+}
+
+void RigidBodySystem::findSphereCollisions(const int &i1, const int &i2, std::vector<RigidBodyCollision> &out) const noexcept
+{
+    //Find all collision points between potentially intersecting Spheres objects.
+    if (sphereTreeRanges[i1].first < sphereTreeRanges[i1].last || sphereTreeRanges[i2].first < sphereTreeRanges[i2].last)
     {
-        //Apply forces.
-        for (auto &b : bodies)
-        {
-            b.f = vec3(0.0f);
-            b.t = vec3(0.0f);
-        }
+        findSphereTreeCollisions(i1, i2, out);
+        return;
+    }
 
-        applyExternalForces();
-        
-        //Initialize non-collision constraints.
-        for (auto &c : constraints)
+    //Compare each sphere of the first body with fixed-width blocks of spheres of the second body, such that the inner loop can be vectorized.
+    const int n1 = bodies[i1].lastInternalSphere - bodies[i1].firstInternalSphere;
+    const int o1 = collisionSphereOffsets[i1];
+    const int o2 = collisionSphereOffsets[i2];
+    const int w2 = collisionSphereOffsets[i2 + 1] - o2;
+    const float *x2 = &collisionSphereX[o2];
+    const float *y2 = &collisionSphereY[o2];
+    const float *z2 = &collisionSphereZ[o2];
+    const float *r2 = &collisionSphereR[o2];
+
+    for (int iS1 = 0; iS1 < n1; ++iS1)
+    {
+        const float x1 = collisionSphereX[o1 + iS1];
+        const float y1 = collisionSphereY[o1 + iS1];
+        const float z1 = collisionSphereZ[o1 + iS1];
+        const float r1 = collisionSphereR[o1 + iS1];
+
+        for (int j = 0; j < w2; j += RBSPHEREWIDTH)
         {
-            c.lambda = 0.0f;
-            c.forceToZero = false;
-        }
+            bool hit[RBSPHEREWIDTH];
+            bool anyHit = false;
 
-        //Store pre-update positions and velocities.
-        preBodies = bodies;
+            for (int k = 0; k < RBSPHEREWIDTH; ++k)
+            {
+                const float dx = x1 - x2[j + k];
+                const float dy = y1 - y2[j + k];
+                const float dz = z1 - z2[j + k];
 
-        //Apply forces and velocities.
-        for (auto &b : bodies)
-        {
-            if (b.movable)
+                hit[k] = (std::sqrt(dx*dx + dy*dy + dz*dz) <= r1 + r2[j + k]);
+            }
+
+            for (int k = 0; k < RBSPHEREWIDTH; ++k)
             {
-                b.v += (h*b.invM)*b.f;
-                b.x += h*b.v;
+                anyHit |= hit[k];
+            }
 
-                b.w += h*(b.getInvI()*(b.t - cross(b.w, b.getI()*b.w)));
-                b.q += (0.5f*h)*quatmul(vec4(b.w, 0.0f), b.q);
-                b.q = normalize(b.q);
+            if (!anyHit) continue;
+
+            for (int k = 0; k < RBSPHEREWIDTH; ++k)
+            {
+                //If so, add a potential collision.
+                if (hit[k]) addSphereCollision(i1, iS1, i2, j + k, out);
             }
         }
+    }
+}
 
-        //Solve positions.
-        
-        //Collisions.
-        std::random_shuffle(collisions.begin(), collisions.end());
+void RigidBodySystem::findSphereTreeCollisions(const int &i1, const int &i2, std::vector<RigidBodyCollision> &out) const noexcept
+{
+    //Traverse the bounding sphere hierarchies of both bodies simultaneously, a body without hierarchy acts as a single leaf (node -1).
+    //Collisions are reported in the same order as by the plain comparison in findSphereCollisions().
+    const size_t firstOut = out.size();
+    const int o1 = collisionSphereOffsets[i1];
+    const int o2 = collisionSphereOffsets[i2];
+    const int n1 = bodies[i1].lastInternalSphere - bodies[i1].firstInternalSphere;
+    const int n2 = bodies[i2].lastInternalSphere - bodies[i2].firstInternalSphere;
+    //Each pair on the stack descends one level in either hierarchy, so it holds at most one pending pair per level of both, plus one.
+    std::array<std::pair<int, int>, 2*RBSPHERETREEDEPTH + 2> stack;
+    int stackSize = 0;
+
+    stack[stackSize++] = {(sphereTreeRanges[i1].first < sphereTreeRanges[i1].last ? sphereTreeRanges[i1].first : -1),
+                          (sphereTreeRanges[i2].first < sphereTreeRanges[i2].last ? sphereTreeRanges[i2].first : -1)};
+
+    while (stackSize > 0)
+    {
+        const auto [k1, k2] = stack[--stackSize];
 
-        for (auto &c : collisions)
+        if (k1 >= 0 && k2 >= 0)
         {
-            c.lambda = 0.0f;
+            const vec4 s1 = sphereTreeSpheres[k1];
+            const vec4 s2 = sphereTreeSpheres[k2];
+
+            if (length(s1.xyz() - s2.xyz()) > s1.w + s2.w) continue;
         }
 
-        for (auto &c : collisions)
+        const bool leaf1 = (k1 < 0 || sphereTreeNodes[k1].left < 0);
+        const bool leaf2 = (k2 < 0 || sphereTreeNodes[k2].left < 0);
+
+        if (leaf1 && leaf2)
         {
-            //Check whether we have a collision for the current rigid body state.
-            c = initializeCollision(c);
+            const int first1 = (k1 < 0 ? 0 : sphereTreeNodes[k1].first);
+            const int last1 = (k1 < 0 ? n1 : sphereTreeNodes[k1].last);
+            const int first2 = (k2 < 0 ? 0 : sphereTreeNodes[k2].first);
+            const int last2 = (k2 < 0 ? n2 : sphereTreeNodes[k2].last);
 
-            //Check for collision for the current body states.
-            if (c.d <= 0.0f || c.forceToZero)
+            for (int a = first1; a < last1; ++a)
             {
-                //Force constraint to be satisfied exactly if it is violated at least once.
-                c.forceToZero = true;
-
-                const auto cg = getWorldGeometry(bodies, c.b1, c.b2);
-                RigidBody *b1 = &bodies[c.b1.i];
-                RigidBody *b2 = &bodies[c.b2.i];
+                const int iS1 = (k1 < 0 ? a : sphereTreeIndices[a]);
+                const float x1 = collisionSphereX[o1 + iS1];
+                const float y1 = collisionSphereY[o1 + iS1];
+                const float z1 = collisionSphereZ[o1 + iS1];
+                const float r1 = collisionSphereR[o1 + iS1];
 
-                const float softnessCoeff = 0.5f*(b1->softness + b2->softness)/(h*h);
-                
-                //Apply position constraint to avoid object interpenetration.
-                auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, b2, 0.5f*(cg.p1 + cg.p2), -c.d*c.n);
-                
-                c.lambda += l;
-                
-                //Handle static friction.
-                const float staticFrictionCoeff = std::sqrt(b1->staticFriction*b2->staticFriction);
-                const auto precg = getWorldGeometry(preBodies, c.b1, c.b2);
-                
-                //Figure out how the current collision point has moved w.r.t. the previous iteration on both bodies.
-                //N.B., we need to track a fixed point on the rigid body.
-                vec3 dx = (precg.p2 - cg.p2) - (precg.p1 - cg.p1);
-
-                dx -= dot(dx, c.n)*c.n;
-
-                //Inspect normal forces.
-                if (c.b2.i == 0 && false)
+                for (int b = first2; b < last2; ++b)
                 {
-                    std::cout << "Normal force of " << c.b1.i << ": " << std::abs(c.lambda)/(h*h) << "N, coeff " << staticFrictionCoeff << std::endl;
-                    std::cout << "Tangential force of " << c.b1.i << ": " << length(dx)/(h*h*(w1 + w2)) << "N, 1/w1 = " << 1.0f/w1 << "kg, 1/w2 = " << 1.0f/w2 << "kg" << std::endl;
-                }
+                    const int iS2 = (k2 < 0 ? b : sphereTreeIndices[b]);
+                    const float dx = x1 - collisionSphereX[o2 + iS2];
+                    const float dy = y1 - collisionSphereY[o2 + iS2];
+                    const float dz = z1 - collisionSphereZ[o2 + iS2];
 
-                //Static friction, restrict tangential motion if F_tangential <= mu_static * F_normal.
-                if (length(dx)/(w1 + w2) <= staticFrictionCoeff*std::abs(c.lambda))
-                {
-                    applyPositionConstraint(0.0f, softnessCoeff, b1, b2, 0.5f*(cg.p1 + cg.p2), dx);
+                    if (std::sqrt(dx*dx + dy*dy + dz*dz) <= r1 + collisionSphereR[o2 + iS2])
+                    {
+                        addSphereCollision(i1, iS1, i2, iS2, out);
+                    }
                 }
             }
         }
-
-        //Apply position constraints.
-        //TODO: Randomly shuffle constraints.
-        //std::random_shuffle(constraints.begin(), constraints.end());
-
-        for (auto &c : constraints)
+        else
         {
-            const float softnessCoeff = 0.5f*c.softness/(h*h);
-            RigidBody *b1 = &bodies[c.b1.i];
-            RigidBody *b2 = &bodies[c.b2.i];
-            const vec3 p1 = mat3::rotationMatrix(b1->q)*c.b1.r + b1->x;
-            const vec3 p2 = mat3::rotationMatrix(b2->q)*c.b2.r + b2->x;
-            //FIXME: How to pick a good point where to apply the constraint?
-            const vec3 p = (!b1->movable ? p2 : (!b2->movable ? p1 : 0.5f*(p1 + p2)));
-            const vec3 n = mat3::rotationMatrix(b1->q)*c.n;
-            const vec3 a = cross(mat3::rotationMatrix(b1->q)*c.b1.r, mat3::rotationMatrix(b2->q)*c.b2.r);
-            float d = 0.0f;
-
-            switch (c.type)
+            //Descend into the larger node, the capped depth of the hierarchies guarantees room on the stack.
+            assert(stackSize + 2 <= static_cast<int>(stack.size()));
+
+            if (leaf2 || (!leaf1 && sphereTreeNodes[k1].s.w >= sphereTreeNodes[k2].s.w))
             {
-                case Constraint::Position:
-                    //Position constraint along all axes up to a maximum distance. (For d == 0 this is an equal-position-constraint.)
-                    d = length(p2 - p1) - c.d;
+                stack[stackSize++] = {sphereTreeNodes[k1].right, k2};
+                stack[stackSize++] = {sphereTreeNodes[k1].left, k2};
+            }
+            else
+            {
+                stack[stackSize++] = {k1, sphereTreeNodes[k2].right};
+                stack[stackSize++] = {k1, sphereTreeNodes[k2].left};
+            }
+        }
+    }
 
-                    if (d > 0.0f || c.forceToZero)
-                    {
-                        auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, b2, p, -d*normalize(p2 - p1));
-                        c.forceToZero = true;
-                        c.lambda += l;
-                    }
+    std::sort(out.begin() + firstOut, out.end(), [](const RigidBodyCollision &a, const RigidBodyCollision &b)
+    {
+        return (a.b1.sphere < b.b1.sphere || (a.b1.sphere == b.b1.sphere && a.b2.sphere < b.b2.sphere));
+    });
+}
 
-                    break;
-                case Constraint::PositionOnLine:
-                    //Position along a given line up to a maximum distance.
+void RigidBodySystem::addSphereCollision(const int &i1, const int &iS1, const int &i2, const int &iS2, std::vector<RigidBodyCollision> &out) const noexcept
+{
+    //Add a potential collision between two internal spheres.
+    const vec3 m = (speculativeContactsEnabled ? normalize(getCollisionSphere(i2, iS2).xyz() - getCollisionSphere(i1, iS1).xyz()) : vec3(0.0f));
 
-                    //First project delta on the line.
-                    if (true)
-                    {
-                        auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, b2, p, -((p2 - p1) - dot(p2 - p1, n)*n));
-                        c.lambda += l;
-                    }
+    out.push_back(RigidBodyCollision({{i1, iS1, vec3(0.0f)},
+                                      {i2, iS2, vec3(0.0f)},
+                                      0.0f, vec3(0.0f), m, {vec3(0.0f), vec3(0.0f), vec3(0.0f)}, 0.0f, 0.0f, false}));
+}
 
-                    //Then enforce the maximum extent we can move along the line.
-                    d = dot(p2 - p1, n) - c.d;
+vec3 getTriangleNormalAwayFrom(const vec3 &p, const std::array<vec3, 3> &t) noexcept
+{
+    //Normal of the triangle's plane pointing away from p.
+    const vec3 n = cross(t[1] - t[0], t[2] - t[0]);
 
-                    if (d > 0.0f || c.forceToZero)
-                    {
-                        auto [l, w1, w2] = applyPositionConstraint(c.lambda, softnessCoeff, b1, b2, p, -d*n);
-                        c.forceToZero = true;
-                        c.lambda += l;
-                    }
+    return normalize(dot(p - t[0], n) > 0.0f ? -n : n);
+}
 
-                    break;
-                case Constraint::Orientation:
-                    //Constrain relative orientation up to a maximum distance.
-                    d = length(a) - c.d;
-                    
-                    if (d > 0.0f || c.forceToZero)
-                    {
-                        auto [l, w1, w2] = applyAngularConstraint(c.lambda, softnessCoeff, b1, b2, -d*normalize(a));
-                        c.forceToZero = true;
-                        c.lambda += l;
-                    }
+void RigidBodySystem::findTriangleCollisions(const int &iB, std::vector<RigidBodyCollision> &out, std::vector<std::array<vec3, 3>> &triangles) const noexcept
+{
+    //Find all potential collisions between Spheres and the triangles gathered for this body.
+    const RigidBody &b = bodies[iB];
+    float collisionRadius = b.collisionRadius;
 
-                    break;
-                default:
-                    break;
-            }
-        }
-        
-        //Update velocities.
-        for (size_t i = 0; i < bodies.size(); ++i)
+    //Speculative contacts should also be found for triangles that the body can reach due to its velocity.
+    if (speculativeContactsEnabled && collisionTriangleRanges[iB].first < collisionTriangleRanges[iB].second)
+    {
+        for (auto iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
         {
-            if (bodies[i].movable)
-            {
-                bodies[i].v = (bodies[i].x - preBodies[i].x)/h;
-
-                const vec4 dq = quatmul(bodies[i].q, quatconj(preBodies[i].q));
+            const vec4 s = getCollisionSphere(iB, iS - b.firstInternalSphere);
 
-                bodies[i].w = (dq.w >= 0.0f ? 2.0f/h : -2.0f/h)*dq.xyz();
-            }
+            collisionRadius = std::max(collisionRadius, length(s.xyz() - b.x) + s.w);
         }
+    }
 
-        //Solve velocities.
+    for (int i = collisionTriangleRanges[iB].first; i < collisionTriangleRanges[iB].second; i += 3)
+    {
+        const std::array<vec3, 3> t = {{collisionTriangles[i], collisionTriangles[i + 1], collisionTriangles[i + 2]}};
 
-        //Velocity update for position constraints.
-        for (auto &c : constraints)
+        //Can the body intersect with the triangle?
+        if (length(b.x - getClosestPointOnTriangle(b.x, t)) <= collisionRadius)
         {
-            if (c.forceToZero)
+            for (auto iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
             {
-                const auto cg = getWorldGeometry(bodies, c.b1, c.b2);
-                RigidBody *b1 = &bodies[c.b1.i];
-                RigidBody *b2 = &bodies[c.b2.i];
-                const vec3 n = mat3::rotationMatrix(b1->q)*c.n;
+                //Get potential collisions taking the object's velocity (linear and angular) into account.
+                const vec4 s = getCollisionSphere(iB, iS - b.firstInternalSphere);
+                const vec3 p = getClosestPointOnTriangle(s.xyz(), t);
                 
-                switch (c.type)
+                if (length(p - s.xyz()) <= s.w)
                 {
-                    case Constraint::Position:
-                        //Should have relative velocity 0 at a position constraint.
-                        applyVelocityConstraint(b1, b2, cg.p1 - b1->x, cg.p2 - b2->x, cg.v1 - cg.v2);
-                        break;
-                    case Constraint::PositionOnLine:
-                        applyVelocityConstraint(b1, b2, cg.p1 - b1->x, cg.p2 - b2->x, dot(cg.v1 - cg.v2, n)*n);
-                        break;
-                    case Constraint::Orientation:
-                        //TODO.
-                        break;
+                    //If so, add a potential collision.
+                    out.push_back(RigidBodyCollision({{iB, iS - b.firstInternalSphere, vec3(0.0f)},
+                                                      {0, 0, vec3(0.0f)},
+                                                      0.0f, vec3(0.0f), (speculativeContactsEnabled ? getTriangleNormalAwayFrom(s.xyz(), t) : vec3(0.0f)), t, 0.0f, 0.0f, false}));
                 }
             }
         }
+    }
 
-        //Velocity update for collisions.
-        for (size_t i = 0; i < collisions.size(); ++i)
-        {
-            const auto c = collisions[i];
-            
-            //Did we have a collision?
-            if (c.forceToZero)
-            {
-                const auto cg = getWorldGeometry(bodies, c.b1, c.b2);
-                RigidBody *b1 = &bodies[c.b1.i];
-                RigidBody *b2 = &bodies[c.b2.i];
-
-                //Determine normal and tangential relative velocities.
-                vec3 vt = cg.v1 - cg.v2;
-                const float vn = dot(vt, c.n);
-                
-                vt -= vn*c.n;
-                
-                //Apply dynamic friction.
-                const float dynamicFrictionCoeff = std::sqrt(b1->dynamicFriction*b2->dynamicFriction);
+    //Query the static colliders for each internal sphere separately.
+    if (staticColliders.empty() || !isActive(iB) || !layersCanCollide(iB, 0)) return;
 
-                applyVelocityConstraint(b1, b2, cg.p1 - b1->x, cg.p2 - b2->x,
-                                        std::min(dynamicFrictionCoeff*std::abs(c.lambda)/h, length(vt))*normalize(vt));
-                
-                //Perform restitution in case of collisions that are not resting contacts.
+    for (auto iS = b.firstInternalSphere; iS < b.lastInternalSphere; ++iS)
+    {
+        const vec4 s = getCollisionSphere(iB, iS - b.firstInternalSphere);
 
-                //Get pre-state normal velocity.
-                const auto precg = getWorldGeometry(preBodies, c.b1, c.b2);
-                const float prevn = dot(precg.v1 - precg.v2, c.n);
-                const float restitutionCoeff = (std::abs(prevn) > h*RBMAXACC ? 
-                                std::sqrt(b1->restitution*b2->restitution) :
-                                0.0f);
+        triangles.clear();
 
-                applyVelocityConstraint(b1, b2, cg.p1 - b1->x, cg.p2 - b2->x,
-                                        (vn + std::max(0.0f, restitutionCoeff*prevn))*c.n);
-            }
+        for (const auto &c : staticColliders)
+        {
+            c->getTriangles(s, triangles);
         }
-    }
 
-    //Calculate total energy and momenta.
-    totalEnergy = 0.0f;
-    totalLinearMomentum = vec3(0.0f);
-    totalAngularMomentum = vec3(0.0f);
-    
-    for (const auto &b : bodies)
-    {
-        if (b.movable)
+        for (const auto &t : triangles)
         {
-            totalEnergy += (0.5f/b.invM)*length2(b.v) + 0.5f*dot(b.w, b.getI()*b.w);
-            totalLinearMomentum += (1.0f/b.invM)*b.v;
-            totalAngularMomentum += (1.0f/b.invM)*cross(b.x, b.v) + b.getI()*b.w;
+            if (length(getClosestPointOnTriangle(s.xyz(), t) - s.xyz()) <= s.w)
+            {
+                out.push_back(RigidBodyCollision({{iB, iS - b.firstInternalSphere, vec3(0.0f)},
+                                                  {0, 0, vec3(0.0f)},
+                                                  0.0f, vec3(0.0f), (speculativeContactsEnabled ? getTriangleNormalAwayFrom(s.xyz(), t) : vec3(0.0f)), t, 0.0f, 0.0f, false}));
+            }
         }
     }
-
-    totalEnergy += potentialEnergy();
-    
-    //Increment global time.
-    time += dt;
 }
 
 std::vector<vec3> RigidBodySystem::getCollisionTriangles(const RigidBody &)
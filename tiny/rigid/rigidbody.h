@@ -20,9 +20,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <list>
 #include <map>
 #include <set>
+#include <unordered_set>
+#include <cstdint>
+#include <random>
+#include <limits>
+#include <algorithm>
 
 #include <tiny/math/vec.h>
+#include <tiny/os/threadpool.h>
 #include <tiny/rigid/aabbtree.h>
+#include <tiny/rigid/sortedaxis.h>
+#include <tiny/rigid/hashgrid.h>
+#include <tiny/rigid/collider.h>
 
 #include <tiny/draw/staticmeshhorde.h>
 
@@ -32,7 +41,8 @@ namespace tiny
 namespace rigid
 {
 
-//TODO: Structure of arrays instead of array of structures.
+//Bodies are stored as an array of structures for convenient access from derived systems.
+//The solver only keeps a compact copy of the state it reads back at the start of each substep (see RigidBodySubStepState).
 struct RigidBody
 {
     float invM; //Inverse mass.
@@ -46,6 +56,9 @@ struct RigidBody
 
     bool movable; //Is the object movable at all (default yes).
     bool canCollide; // Can the object collide with other objects at all?
+    bool asleep; //Is the object deactivated because it has been at rest for some time?
+    uint32_t collisionLayers; //Bitmask of collision layers the object belongs to (default layer 0).
+    uint32_t collisionMask; //Bitmask of collision layers the object collides with (default all).
     
     //Body sphere geometry.
     float radius; //Size of rigid body.
@@ -98,13 +111,96 @@ struct TwoRigidBodyPointGeometry
     vec3 v1, v2; //Velocities of colliding points in world coorindate system.
 };
 
+struct RigidBodySphereNode
+{
+    vec4 s; //Bounding sphere of all internal spheres in this node in body coordinates.
+    int first, last; //Range of RigidBodySystem::sphereTreeIndices containing the internal spheres of this node.
+    int left, right; //Child nodes, or -1 for leaves.
+};
+
+struct RigidBodySphereTreeRange
+{
+    int first, last; //Range of RigidBodySystem::sphereTreeNodes belonging to a body with the root at first, empty without hierarchy.
+};
+
+struct RigidBodyHandle
+{
+    int index; //Index of the body.
+    uint32_t generation; //Generation of the body's slot, such that handles to removed bodies can be detected after the slot is reused.
+};
+
+struct RigidBodySubStepState
+{
+    vec3 x; //Position.
+    vec4 q; //Orientation.
+    vec3 v; //Linear velocity.
+    vec3 w; //Angular velocity.
+    mat3 R; //Rotation matrix of the orientation.
+};
+
+struct RigidBodyTransform
+{
+    mat3 R; //Rotation matrix of the body's orientation.
+    mat3 invI; //Inverse inertia tensor in world coordinates.
+    bool valid; //Do R and invI match the current orientation of the body?
+};
+
+struct RigidBodySleepState
+{
+    float restTime; //Time the body has been moving slower than the sleeping thresholds.
+    int nextInIsland; //Next body in the circular list of bodies that fell asleep together.
+    bool wakeUp; //Should the body be woken up at the next update?
+    vec3 f, t; //Applied force and torque when the body fell asleep.
+};
+
+struct RigidBodyRayHit
+{
+    int body; //Index of the body that was hit.
+    int sphere; //Index of the body's internal sphere that was hit.
+    float distance; //Distance along the ray until the hit.
+    vec3 p; //Point of contact on the body in world coordinates.
+    vec3 n; //Outward surface normal of the body at the point of contact.
+};
+
+struct RigidBodyPair
+{
+    int i1, i2; //Bodies with overlapping bounding boxes, i1 < i2.
+    bool nonColliding; //Have collisions between these bodies been disabled?
+    float lambda; //Total collision constraint multiplier at the end of the previous update.
+
+    inline bool operator < (const RigidBodyPair &a) const noexcept
+    {
+        return (i1 < a.i1 || (i1 == a.i1 && i2 < a.i2));
+    }
+};
+
+struct RigidBodyWarmStart
+{
+    int i1, s1, i2, s2; //Bodies and their internal spheres in contact.
+    vec3 t; //Centroid of the triangle in case i2 == 0.
+    float lambda; //Correction along the collision normal divided by the squared substep time.
+
+    inline bool operator < (const RigidBodyWarmStart &a) const noexcept
+    {
+        if (i1 != a.i1) return i1 < a.i1;
+        if (s1 != a.s1) return s1 < a.s1;
+        if (i2 != a.i2) return i2 < a.i2;
+        if (s2 != a.s2) return s2 < a.s2;
+        if (t.x != a.t.x) return t.x < a.t.x;
+        if (t.y != a.t.y) return t.y < a.t.y;
+        return t.z < a.t.z;
+    }
+};
+
 struct RigidBodyCollision
 {
     PointOnRigidBody b1, b2;
     float d; //Signed distance of b2 w.r.t. b1 along the collision normal. A collision occurs if d <= 0.
     vec3 n; //Normal of collision surface.
+    vec3 m; //Normal at contact generation, used by speculative contacts to stay on the original side.
     std::array<vec3, 3> t; //Triangle in case b2.i == 0.
     float lambda; //Constraint multiplier.
+    float warmStart; //Total correction along the normal during the last substep, used for warm starting.
     bool forceToZero; //Force constraint to equality if it has been violated at least once.
 };
 
@@ -124,9 +220,101 @@ struct Constraint
     
     float softness; //Constraint inverse stiffness.
     float lambda;
+    vec3 correction; //Total correction applied during the last substep (world coordinates), used for warm starting.
     bool forceToZero; //Force constraint to equality if it has been violated at least once.
 };
 
+struct RigidBodyStatistics
+{
+    RigidBodyStatistics() :
+        broadPhaseTime(0.0),
+        narrowPhaseTime(0.0),
+        batchTime(0.0),
+        totalTime(0.0),
+        nrReinserts(0),
+        nrPairs(0),
+        nrContacts(0),
+        constraintError(0.0f),
+        subStepTimes(),
+        nrViolatedConstraints()
+    {
+
+    }
+
+    //All times are in milliseconds.
+    double broadPhaseTime; //Refitting the broad phase and updating overlapping pairs.
+    double narrowPhaseTime; //Generating potential contacts.
+    double batchTime; //Partitioning constraints into independent batches.
+    double totalTime; //Complete update.
+    int nrReinserts; //Number of bodies reinserted into the broad phase.
+    int nrPairs; //Number of pairs of bodies with overlapping AABBs.
+    int nrContacts; //Number of potential contacts.
+    float constraintError; //Largest penetration or constraint violation after the final substep (adaptive substeps only).
+    std::vector<double> subStepTimes; //Time spent in each substep.
+    std::vector<int> nrViolatedConstraints; //Number of contacts and constraints that were enforced in each substep.
+
+    friend std::ostream & operator << (std::ostream &Out, const RigidBodyStatistics &s)
+    {
+        Out << "Broad phase: " << s.broadPhaseTime << "ms, " << s.nrReinserts << " reinserts, " << s.nrPairs << " pairs"
+            << ", narrow phase: " << s.narrowPhaseTime << "ms, " << s.nrContacts << " contacts"
+            << ", batches: " << s.batchTime << "ms"
+            << ", " << s.subStepTimes.size() << " substeps (error " << s.constraintError << "):";
+        
+        for (size_t i = 0; i < s.subStepTimes.size(); ++i)
+        {
+            Out << " " << s.subStepTimes[i] << "ms (" << s.nrViolatedConstraints[i] << ")";
+        }
+
+        Out << ", total: " << s.totalTime << "ms" << std::endl;
+
+        return Out;
+    }
+};
+
+//Broad phase structures that can be used to find potentially colliding bodies, which all yield the same pairs.
+enum class RigidBodyBroadPhase
+{
+    Tree, //Dynamic AABB tree, suitable for bodies of very different sizes.
+    SortedAxis, //Incremental sort along the x-axis, suitable for coherently moving bodies of similar size.
+    HashGrid //Uniform grid, suitable for bodies of similar size that are comparable to the cell size.
+};
+
+//Complete simulation state of a RigidBodySystem, which can be restored to roll back the simulation.
+//All containers hold trivially copyable types, such that repeated snapshots reuse their storage.
+struct RigidBodySystemSnapshot
+{
+    float time;
+    float totalEnergy;
+    vec3 totalLinearMomentum;
+    vec3 totalAngularMomentum;
+    std::vector<RigidBody> bodies;
+    std::vector<Constraint> constraints;
+    std::vector<int> freeConstraints;
+    std::vector<vec4> bodyInternalSpheres;
+    std::vector<RigidBodySphereNode> sphereTreeNodes;
+    std::vector<int> sphereTreeIndices;
+    std::vector<RigidBodySphereTreeRange> sphereTreeRanges;
+    std::vector<std::pair<int, int>> freeInternalSpheres;
+    int nrFreeInternalSpheres, nrFreeSphereTreeNodes;
+    std::vector<uint32_t> bodyGenerations;
+    std::vector<int> freeBodies;
+    std::vector<uint64_t> nonCollidingBodies;
+    std::vector<RigidBodySleepState> sleepStates;
+    std::vector<RigidBodyPair> pairs;
+    std::vector<RigidBodyWarmStart> warmStarts;
+    std::vector<int> movedBodies;
+    std::vector<int> bodiesOutsideBroadPhase;
+    std::vector<bool> bodyInStaticTree;
+    int nrCurrentSubSteps;
+    float constraintError;
+    RigidBodyBroadPhase broadPhaseType;
+    aabb::Tree tree;
+    aabb::SortedAxis sortedAxis;
+    aabb::HashGrid hashGrid;
+    aabb::Tree staticTree;
+    std::minstd_rand random;
+};
+
 class RigidBodySystem
 {
     public:
@@ -140,12 +328,53 @@ class RigidBodySystem
             const vec3 &, const vec3 & = vec3(0.0f, 0.0f, 0.0f),
             const vec4 & = vec4(0.0f, 0.0f, 0.0f, 1.0f), const vec3 & = vec3(0.0f, 0.0f, 0.0f),
             const float & = 0.6f, const float & = 0.5f, const float & = 0.7f, const float & = 0.0f); //Friction/restitution ~steel/aluminum.
-        //TODO: Ability to remove rigid bodies.
+
+        //Removed bodies keep their index, which is reused by subsequently added bodies, use handles to detect this.
+        void removeRigidBody(const int &);
+        void removeRigidBody(const RigidBodyHandle &);
+        bool isRigidBodyRemoved(const int &) const noexcept;
+        RigidBodyHandle getRigidBodyHandle(const int &) const;
+        int getRigidBodyIndex(const RigidBodyHandle &) const noexcept;
+        int getNrBodies() const noexcept;
 
         void addNonCollidingPair(const int &, const int &);
+        void setCollisionLayers(const int &, const uint32_t &, const uint32_t &);
+        void addStaticCollider(const StaticCollider *);
         int addPositionConstraint(const int &, const vec3 &, const int &, const vec3 &, const float & = 0.0f, const float & = 0.0f);
         int addPositionLineConstraint(const int &, const vec3 &, const vec3 &, const int &, const vec3 &, const float & = 0.0f, const float & = 0.0f);
         int addAngularConstraint(const int &, const vec3 &, const int &, const vec3 &, const float & = 0.0f, const float & = 0.0f);
+        //Removed constraints keep their index, which is reused by subsequently added constraints, such that other indices remain valid.
+        void removeConstraint(const int &);
+        bool isConstraintRemoved(const int &) const noexcept;
+
+        void setNrThreads(const int &);
+        int getNrThreads() const noexcept;
+
+        void setBroadPhase(const RigidBodyBroadPhase &, const float & = 1.0f);
+        RigidBodyBroadPhase getBroadPhase() const noexcept;
+
+        void setRandomSeed(const unsigned int &);
+        void saveSnapshot(RigidBodySystemSnapshot &) const;
+        void restoreSnapshot(const RigidBodySystemSnapshot &);
+
+        void setStatistics(const bool &);
+        const RigidBodyStatistics &getStatistics() const noexcept;
+
+        void setSleeping(const bool &, const float & = 0.1f, const float & = 0.1f, const float & = 1.0f);
+        void setWarmStarting(const bool &, const float & = 0.9f);
+        void setSpeculativeContacts(const bool &);
+        void setAdaptiveSubSteps(const bool &, const float & = 1.0e-3f, const int & = 1, const int & = 16);
+        int getNrSubSteps() const noexcept;
+        bool isRigidBodyAsleep(const int &) const;
+        void wakeRigidBody(const int &);
+        void applyImpulse(const int &, const vec3 &, const vec3 &);
+
+        //Scene queries against all bodies in the broad phase, excluding body 0.
+        bool castRay(const vec3 &, const vec3 &, RigidBodyRayHit &, const float & = std::numeric_limits<float>::max()) const;
+        void castRayAll(const vec3 &, const vec3 &, std::vector<RigidBodyRayHit> &, const float & = std::numeric_limits<float>::max()) const;
+        bool castSphere(const vec4 &, const vec3 &, RigidBodyRayHit &, const float & = std::numeric_limits<float>::max()) const;
+        void getBodiesInSphere(const vec4 &, std::vector<int> &) const;
+        void getBodiesInBox(const aabb::aabb &, std::vector<int> &) const;
 
         void getRigidBodyPositionAndOrientation(const int &, vec3 &, vec4 &) const;
         void getRigidBodyVelocityAndAngularVelocity(const int &, vec3 &, vec3 &) const;
@@ -179,6 +408,68 @@ class RigidBodySystem
             }
         }
 
+        int getNrInternalSpheres() const noexcept
+        {
+            return bodyInternalSpheres.size();
+        }
+
+        //Write internal spheres straight into an array of StaticMeshInstance-compatible elements, e.g., StaticMeshHorde::getInstances().
+        //Only positions and orientations are written, sphere i ends up at out[i], and the number of written instances is returned.
+        template <typename Instance>
+        int writeInternalSphereStaticMeshes(Instance *out, const int &maxNrOut, const bool &parallel = false)
+        {
+            const int nrOut = std::min(maxNrOut, getNrInternalSpheres());
+
+            forEachBodyRange(bodies.size(), parallel, [&](const int &first, const int &last)
+            {
+                for (int j = first; j < last; ++j)
+                {
+                    const RigidBody &b = bodies[j];
+                    const mat3 R = mat3::rotationMatrix(b.q);
+
+                    for (int i = b.firstInternalSphere; i < std::min(b.lastInternalSphere, nrOut); ++i)
+                    {
+                        const vec4 s = bodyInternalSpheres[i];
+
+                        out[i].positionAndSize = vec4(b.x + R*s.xyz(), s.w);
+                        out[i].orientation = b.q;
+                    }
+                }
+            });
+
+            //Hide internal spheres of removed bodies that have not been reused yet.
+            for (const auto &r : freeInternalSpheres)
+            {
+                for (int i = r.first; i < std::min(r.second, nrOut); ++i)
+                {
+                    out[i].positionAndSize = vec4(0.0f);
+                    out[i].orientation = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+                }
+            }
+
+            return nrOut;
+        }
+
+        //Write bodies in[0], in[1], ... to out[0], out[1], ..., similar to writeInternalSphereStaticMeshes().
+        template <typename Instance, typename List>
+        int writeStaticMeshes(Instance *out, const int &maxNrOut, const List &in, const bool &parallel = false)
+        {
+            const int nrOut = std::min(maxNrOut, static_cast<int>(in.size()));
+
+            forEachBodyRange(nrOut, parallel, [&](const int &first, const int &last)
+            {
+                for (int j = first; j < last; ++j)
+                {
+                    const RigidBody &b = bodies[in[j]];
+
+                    out[j].positionAndSize = vec4(b.x, 1.0f);
+                    out[j].orientation = b.q;
+                }
+            });
+
+            return nrOut;
+        }
+
         float getTime() const;
         
         friend std::ostream & operator << (std::ostream &Out, const RigidBodySystem &b)
@@ -190,11 +481,15 @@ class RigidBodySystem
                 << ", P = " << b.totalLinearMomentum
                 << ", L = " << b.totalAngularMomentum
                 << std::endl;
+            
+            if (b.statisticsEnabled) Out << b.statistics;
 
             return Out;
         }
 
     protected:
+        //Called once per substep to set the forces and torques of all bodies, including sleeping ones.
+        //A sleeping body whose force or torque differs from when it fell asleep is woken at the start of the next update.
         virtual void applyExternalForces();
         virtual float potentialEnergy() const;
         virtual std::vector<vec3> getCollisionTriangles(const RigidBody &);
@@ -206,20 +501,174 @@ class RigidBodySystem
 
         std::vector<RigidBody> bodies;
         std::vector<Constraint> constraints;        
+        //Slots of removed constraints, which are left between body 0 and itself, available for reuse.
+        std::vector<int> freeConstraints;
         
         const int nrSubSteps;
 
     private:
-        std::vector<RigidBody> preBodies;
+        //Number of substeps used by the most recent update, which is adapted to the remaining constraint error if enabled.
+        int nrCurrentSubSteps;
+        bool adaptiveSubStepsEnabled;
+        float constraintTolerance;
+        int minNrSubSteps, maxNrSubSteps;
+        float constraintError;
+
+
+        //Body state at the start of the current substep, kept per body since contacts read it for random pairs of bodies.
+        std::vector<RigidBodySubStepState> preStates;
+        //Rotation matrices and world inverse inertia tensors of the current body orientations, kept up to date by the solver.
+        std::vector<RigidBodyTransform> transforms;
+        //Only the selected broad phase structure contains the bounding boxes of movable bodies.
+        RigidBodyBroadPhase broadPhaseType;
         aabb::Tree tree;
+        aabb::SortedAxis sortedAxis;
+        aabb::HashGrid hashGrid;
+        aabb::BroadPhase *broadPhase;
+        //Immovable bodies are kept in a separate tree with tight boxes, which are only refitted when the user moves such a body.
+        aabb::Tree staticTree;
         std::vector<vec4> bodyInternalSpheres;
-        std::vector<vec4> collSpheres;
-        std::set<std::pair<int, int>> nonCollidingBodies;
+        //World-space internal spheres with velocity margins, padded to a fixed width per body and stored as separate streams.
+        std::vector<float> collisionSphereX, collisionSphereY, collisionSphereZ, collisionSphereR;
+        std::vector<int> collisionSphereOffsets;
+        //Bounding sphere hierarchies of bodies with many internal spheres, body i owns nodes [sphereTreeRanges[i].first, sphereTreeRanges[i].last).
+        //Leaves refer to internal spheres relative to the body's first through sphereTreeIndices.
+        std::vector<RigidBodySphereNode> sphereTreeNodes;
+        std::vector<int> sphereTreeIndices;
+        std::vector<RigidBodySphereTreeRange> sphereTreeRanges;
+        //Ranges of bodyInternalSpheres and numbers of sphere tree nodes left behind by removed bodies, until they are compacted.
+        std::vector<std::pair<int, int>> freeInternalSpheres;
+        int nrFreeInternalSpheres, nrFreeSphereTreeNodes;
+        //Generation of each body slot, which is odd for removed bodies, and slots available for reuse.
+        std::vector<uint32_t> bodyGenerations;
+        std::vector<int> freeBodies;
+        //World-space bounding spheres of all nodes with velocity margins.
+        std::vector<vec4> sphereTreeSpheres;
+        std::minstd_rand random;
+        //Explicitly excluded pairs of bodies, with the smallest body index in the high 32 bits.
+        std::unordered_set<uint64_t> nonCollidingBodies;
+        std::vector<const StaticCollider *> staticColliders;
+
+        //Persistent pairs of bodies with overlapping bounding boxes, sorted by body indices.
+        std::vector<RigidBodyPair> pairs;
+        std::vector<int> movedBodies;
+        std::vector<bool> bodyMoved;
+        //Bodies that cannot collide with anything are kept out of the broad phase.
+        std::vector<bool> bodyInBroadPhase;
+        std::vector<int> bodiesOutsideBroadPhase;
+        std::vector<bool> bodyInStaticTree;
+        std::vector<RigidBodyPair> newPairs, mergedPairs;
+        std::vector<int> overlappingBodies;
+        std::vector<std::pair<int, int>> overlappingPairs;
+
+        //Worker threads and scratch buffers for the narrow phase.
+        os::ThreadPool threadPool;
+        std::vector<vec3> collisionTriangles;
+        //Range of collisionTriangles gathered for each body.
+        std::vector<std::pair<int, int>> collisionTriangleRanges;
+        std::vector<std::vector<RigidBodyCollision>> threadCollisions;
+        std::vector<std::vector<std::array<vec3, 3>>> threadTriangles;
+
+        //Deactivation of bodies at rest.
+        bool sleepingEnabled;
+        float sleepLinearVelocity;
+        float sleepAngularVelocity;
+        float sleepTime;
+        std::vector<RigidBodySleepState> sleepStates;
+        std::vector<int> islandParents;
+        std::vector<float> islandRestTimes;
+        std::vector<int> lastInIsland;
+        //Bodies woken by a collision or constraint with an active body, whose collisions still have to be found.
+        std::vector<bool> bodyWasAsleep;
+        std::vector<int> wokenBodies, wokenPairs;
+
+        //Speculative contacts that keep their side, and collisions of bodies that move far during a substep as (body, collision) pairs sorted by body.
+        bool speculativeContactsEnabled;
+        std::vector<bool> fastBodies;
+        std::vector<std::pair<int, int>> fastBodyCollisions;
+
+        //Multipliers of the previous update, sorted by contact, to initialize the solver with.
+        bool warmStartingEnabled;
+        float warmStartFactor;
+        std::vector<RigidBodyWarmStart> warmStarts;
+
+        //Timings and counters of the most recent update.
+        bool statisticsEnabled;
+        RigidBodyStatistics statistics;
+
+        //Constraint and collision batches that share no movable bodies, such that they can be solved in parallel.
+        std::vector<std::pair<int, int>> batchBodyPairs;
+        std::vector<uint64_t> bodyColorMasks;
+        std::vector<int> pairColors;
+        std::vector<int> collisionBatchOrder, collisionBatchOffsets;
+        std::vector<int> constraintBatchOrder, constraintBatchOffsets;
         
+        int addConstraint(const Constraint &);
         void calculateInternalSpheres(const RigidBody &, const float &);
+        bool castSphereAtBody(const int &, const vec3 &, const vec3 &, const float &, const float &, RigidBodyRayHit &) const noexcept;
+        template <typename Function>
+        void forEachSphereCastHit(const vec3 &, const vec3 &, const float &, const float &, const Function &) const;
+        bool castSphereFirst(const vec3 &, const vec3 &, const float &, const float &, RigidBodyRayHit &) const;
+        int findPair(const int &, const int &) const noexcept;
+        void updatePairs();
+        float getConstraintError(const std::vector<RigidBodyCollision> &) const noexcept;
+        void updateCollisionSpheres(const float &);
+        void updateTransforms() noexcept;
+        void findCollisions(const float &, std::vector<RigidBodyCollision> &);
+        void findWokenBodyCollisions(std::vector<RigidBodyCollision> &);
+        template <typename PairFunction, typename BodyFunction>
+        void findCollisionsInParallel(const int &, const int &, const PairFunction &, const BodyFunction &, std::vector<RigidBodyCollision> &);
+        void gatherCollisionTriangles(const int &);
+        void findFastBodyCollisions(const std::vector<RigidBodyCollision> &, const float &);
+        void clampTimeOfImpact(const std::vector<RigidBodyCollision> &);
+        vec4 getCollisionSphere(const int &, const int &) const noexcept;
+        int buildSphereTree(const std::vector<vec4> &, const int &, const int &, const int &);
+        int allocateInternalSpheres(const int &);
+        void compactInternalSpheres();
+        void findSphereCollisions(const int &, const int &, std::vector<RigidBodyCollision> &) const noexcept;
+        void findSphereTreeCollisions(const int &, const int &, std::vector<RigidBodyCollision> &) const noexcept;
+        void addSphereCollision(const int &, const int &, const int &, const int &, std::vector<RigidBodyCollision> &) const noexcept;
+        void findTriangleCollisions(const int &, std::vector<RigidBodyCollision> &, std::vector<std::array<vec3, 3>> &) const noexcept;
+        bool isActive(const int &) const noexcept;
+        bool isCollidable(const int &) const noexcept;
+        bool layersCanCollide(const int &, const int &) const noexcept;
+        void updateBroadPhaseMembership();
+        aabb::aabb getBroadPhaseBox(const int &) const noexcept;
+        void getBroadPhaseOverlaps(const aabb::aabb &, std::vector<int> &) const noexcept;
+        void getBodiesOutsideBroadPhase(std::vector<int> &) const noexcept;
+        void wakeIsland(const int &);
+        void wakeDisturbedBodies();
+        bool wakeTouchedIslands(const std::vector<RigidBodyCollision> &);
+        int findIsland(const int &);
+        void updateSleepingBodies(const float &, const std::vector<RigidBodyCollision> &);
+        void colorConstraintGraph(const std::vector<std::pair<int, int>> &, std::vector<int> &, std::vector<int> &);
+        template <typename Function>
+        void forEachBodyRange(const int &n, const bool &parallel, const Function &f)
+        {
+            //Call f(first, last) for ranges covering [0, n), using all threads if requested.
+            if (parallel)
+            {
+                threadPool.parallelFor(n, [&](const int &first, const int &last, const int &)
+                {
+                    f(first, last);
+                });
+            }
+            else
+            {
+                f(0, n);
+            }
+        }
+        template <typename Function>
+        void solveBatches(const std::vector<int> &, const std::vector<int> &, const Function &);
+        void solveCollisionPosition(RigidBodyCollision &, const float &) noexcept;
+        void solveConstraintPosition(Constraint &, const float &) noexcept;
+        void solveConstraintVelocity(const Constraint &) noexcept;
+        void solveCollisionVelocity(const RigidBodyCollision &, const float &) noexcept;
         RigidBodyCollision initializeCollision(RigidBodyCollision) const noexcept;
         float addMarginToRadius(const float, const float) const;
         static TwoRigidBodyPointGeometry getWorldGeometry(const std::vector<RigidBody> &, const PointOnRigidBody &, const PointOnRigidBody &) noexcept;
+        TwoRigidBodyPointGeometry getWorldGeometry(const PointOnRigidBody &, const PointOnRigidBody &) const noexcept;
+        TwoRigidBodyPointGeometry getPreWorldGeometry(const PointOnRigidBody &, const PointOnRigidBody &) const noexcept;
 };
 
 }
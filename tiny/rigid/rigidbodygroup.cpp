@@ -0,0 +1,197 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <cassert>
+#include <algorithm>
+
+#include <tiny/rigid/rigidbodygroup.h>
+
+using namespace tiny;
+using namespace tiny::rigid;
+
+RigidBodySystemGroup::RigidBodySystemGroup(const int &nrThreads) :
+    systems(),
+    systemThreads(),
+    threadPool(nrThreads),
+    systemOrder(),
+    systemOffsets(),
+    threadLoads()
+{
+    groupSystemsByThread();
+}
+
+RigidBodySystemGroup::~RigidBodySystemGroup()
+{
+
+}
+
+void RigidBodySystemGroup::addSystem(RigidBodySystem *system)
+{
+    if (!system || std::find(systems.begin(), systems.end(), system) != systems.end())
+    {
+        std::cerr << "Invalid rigid body system specified for group!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    //Leave the other systems on their threads.
+    const int t = getLeastLoadedThread();
+
+    systems.push_back(system);
+    systemThreads.push_back(t);
+    groupSystemsByThread();
+}
+
+void RigidBodySystemGroup::removeSystem(RigidBodySystem *system)
+{
+    const auto i = std::find(systems.begin(), systems.end(), system);
+
+    if (i == systems.end())
+    {
+        std::cerr << "Rigid body system is not part of this group!" << std::endl;
+        assert(false);
+        return;
+    }
+
+    systemThreads.erase(systemThreads.begin() + (i - systems.begin()));
+    systems.erase(i);
+    groupSystemsByThread();
+}
+
+int RigidBodySystemGroup::getNrSystems() const noexcept
+{
+    return systems.size();
+}
+
+int RigidBodySystemGroup::getSystemThread(const RigidBodySystem *system) const noexcept
+{
+    //Get the thread that updates the given system, or -1 if it is not part of this group.
+    const auto i = std::find(systems.begin(), systems.end(), system);
+
+    return (i == systems.end() ? -1 : systemThreads[i - systems.begin()]);
+}
+
+void RigidBodySystemGroup::setNrThreads(const int &nrThreads)
+{
+    if (nrThreads == threadPool.getNrThreads()) return;
+
+    threadPool.setNrThreads(nrThreads);
+    balanceLoad();
+}
+
+int RigidBodySystemGroup::getNrThreads() const noexcept
+{
+    return threadPool.getNrThreads();
+}
+
+int RigidBodySystemGroup::getLeastLoadedThread()
+{
+    //Find the thread with the fewest bodies in its systems.
+    threadLoads.assign(threadPool.getNrThreads(), 0);
+
+    for (size_t i = 0; i < systems.size(); ++i)
+    {
+        threadLoads[systemThreads[i]] += systems[i]->getNrBodies();
+    }
+
+    return std::min_element(threadLoads.begin(), threadLoads.end()) - threadLoads.begin();
+}
+
+void RigidBodySystemGroup::balanceLoad()
+{
+    //Reassign all systems to threads, largest first to the thread with the fewest bodies so far.
+    const int nrSystems = systems.size();
+    const int nrThreads = threadPool.getNrThreads();
+
+    systemOrder.resize(nrSystems);
+
+    for (int i = 0; i < nrSystems; ++i)
+    {
+        systemOrder[i] = i;
+    }
+
+    std::stable_sort(systemOrder.begin(), systemOrder.end(), [&](const int &a, const int &b)
+    {
+        return systems[a]->getNrBodies() > systems[b]->getNrBodies();
+    });
+
+    systemThreads.resize(nrSystems);
+    threadLoads.assign(nrThreads, 0);
+
+    for (const auto &i : systemOrder)
+    {
+        const int t = std::min_element(threadLoads.begin(), threadLoads.end()) - threadLoads.begin();
+
+        systemThreads[i] = t;
+        threadLoads[t] += systems[i]->getNrBodies();
+    }
+
+    groupSystemsByThread();
+}
+
+void RigidBodySystemGroup::groupSystemsByThread()
+{
+    //Group the systems by thread, keeping them in the order in which they were added.
+    const int nrSystems = systems.size();
+    const int nrThreads = threadPool.getNrThreads();
+
+    systemOrder.resize(nrSystems);
+    systemOffsets.assign(nrThreads + 1, 0);
+
+    for (int i = 0; i < nrSystems; ++i)
+    {
+        ++systemOffsets[systemThreads[i] + 1];
+    }
+
+    for (int t = 0; t < nrThreads; ++t)
+    {
+        systemOffsets[t + 1] += systemOffsets[t];
+    }
+
+    for (int i = 0; i < nrSystems; ++i)
+    {
+        systemOrder[systemOffsets[systemThreads[i]]++] = i;
+    }
+
+    for (int t = nrThreads; t > 0; --t)
+    {
+        systemOffsets[t] = systemOffsets[t - 1];
+    }
+
+    systemOffsets[0] = 0;
+}
+
+void RigidBodySystemGroup::update(const float &dt)
+{
+    //Update all systems by the same time step, with each thread stepping its own share of the systems.
+    //Thread t of the pool always receives the t-th index, so systems stay on their assigned threads.
+    if (systems.empty()) return;
+
+    const int nrThreads = threadPool.getNrThreads();
+
+    threadPool.parallelFor(nrThreads, [&](const int &first, const int &last, const int &)
+    {
+        for (int t = first; t < last; ++t)
+        {
+            for (int i = systemOffsets[t]; i < systemOffsets[t + 1]; ++i)
+            {
+                systems[systemOrder[i]]->update(dt);
+            }
+        }
+    });
+}
+
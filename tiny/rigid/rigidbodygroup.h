@@ -0,0 +1,71 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <vector>
+
+#include <tiny/os/threadpool.h>
+#include <tiny/rigid/rigidbody.h>
+
+namespace tiny
+{
+
+namespace rigid
+{
+
+//Steps many independent rigid body systems concurrently, e.g., one per match hosted by a server.
+//Each system is updated completely by a single thread, which also calls its virtual hooks, such that these only need to be thread-safe across systems.
+//A system is assigned to the least loaded thread when it is added and stays there, until balanceLoad() is called or the number of threads changes.
+//Thread 0 is the thread calling update().
+//The group provides the parallelism, so systems in a group should keep using a single thread each.
+class RigidBodySystemGroup
+{
+    public:
+        RigidBodySystemGroup(const int & = 1);
+        ~RigidBodySystemGroup();
+
+        void addSystem(RigidBodySystem *);
+        void removeSystem(RigidBodySystem *);
+        int getNrSystems() const noexcept;
+
+        void setNrThreads(const int &);
+        int getNrThreads() const noexcept;
+
+        void balanceLoad();
+        int getSystemThread(const RigidBodySystem *) const noexcept;
+
+        void update(const float &);
+
+    private:
+        int getLeastLoadedThread();
+        void groupSystemsByThread();
+
+        std::vector<RigidBodySystem *> systems;
+        //Thread that updates each system.
+        std::vector<int> systemThreads;
+        os::ThreadPool threadPool;
+
+        //Systems assigned to thread t are systemOrder[systemOffsets[t]], ..., systemOrder[systemOffsets[t + 1] - 1].
+        std::vector<int> systemOrder;
+        std::vector<int> systemOffsets;
+        std::vector<long long> threadLoads;
+};
+
+} //rigid
+
+} //tiny
+
@@ -0,0 +1,263 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cassert>
+#include <cfloat>
+#include <iostream>
+#include <algorithm>
+
+#include <tiny/rigid/sortedaxis.h>
+
+using namespace tiny::aabb;
+
+SortedAxis::SortedAxis() :
+    BroadPhase()
+{
+    clear();
+}
+
+SortedAxis::~SortedAxis()
+{
+
+}
+
+void SortedAxis::clear()
+{
+    boxes.clear();
+    contents.clear();
+    present.clear();
+    contentsToIndex.clear();
+    widths.clear();
+    bounds.clear();
+    nrBoxes = 0;
+}
+
+size_t SortedAxis::size() const noexcept
+{
+    return nrBoxes;
+}
+
+int SortedAxis::getIndex(const int &c) const noexcept
+{
+    return (c >= 0 && static_cast<size_t>(c) < contentsToIndex.size() ? contentsToIndex[c] : -1);
+}
+
+void SortedAxis::setBox(const int &c, const aabb &b)
+{
+    //Store a box, or an empty box if it has been erased, and update the maximum widths and unions of all its ancestors.
+    const aabb empty = aabb{vec3(FLT_MAX), vec3(-FLT_MAX)};
+    int nrLeaves = widths.size()/2;
+
+    if (c >= nrLeaves)
+    {
+        //Grow the tree to the next power of two and copy the existing leaves.
+        const int oldNrLeaves = nrLeaves;
+
+        nrLeaves = std::max(1, nrLeaves);
+        while (nrLeaves <= c) nrLeaves *= 2;
+
+        std::vector<float> newWidths(2*nrLeaves, 0.0f);
+        std::vector<aabb> newBounds(2*nrLeaves, empty);
+
+        std::copy(widths.begin() + oldNrLeaves, widths.end(), newWidths.begin() + nrLeaves);
+        std::copy(bounds.begin() + oldNrLeaves, bounds.end(), newBounds.begin() + nrLeaves);
+        widths.swap(newWidths);
+        bounds.swap(newBounds);
+
+        for (int i = nrLeaves - 1; i > 0; --i)
+        {
+            widths[i] = std::max(widths[2*i], widths[2*i + 1]);
+            bounds[i] = cup(bounds[2*i], bounds[2*i + 1]);
+        }
+    }
+
+    int i = nrLeaves + c;
+
+    widths[i] = std::max(0.0f, b.ub.x - b.lb.x);
+    bounds[i] = b;
+
+    for (i /= 2; i > 0; i /= 2)
+    {
+        widths[i] = std::max(widths[2*i], widths[2*i + 1]);
+        bounds[i] = cup(bounds[2*i], bounds[2*i + 1]);
+    }
+}
+
+void SortedAxis::swapEntries(const int &i, const int &j)
+{
+    std::swap(boxes[i], boxes[j]);
+    std::swap(contents[i], contents[j]);
+
+    const bool p = present[i];
+
+    present[i] = present[j];
+    present[j] = p;
+    contentsToIndex[contents[i]] = i;
+    contentsToIndex[contents[j]] = j;
+}
+
+bool SortedAxis::insert(const aabb &box, const int &c)
+{
+    //Insert a box, or reinsert a previously erased one at its old position.
+    if (c < 0)
+    {
+        std::cerr << "Contents of a sorted axis structure should be non-negative!" << std::endl;
+        assert(false);
+        return false;
+    }
+    
+    int i = getIndex(c);
+
+    if (i >= 0 && present[i])
+    {
+        return false;
+    }
+
+    if (i < 0)
+    {
+        i = boxes.size();
+        boxes.push_back(box);
+        contents.push_back(c);
+        present.push_back(true);
+        if (static_cast<size_t>(c) >= contentsToIndex.size()) contentsToIndex.resize(c + 1, -1);
+        contentsToIndex[c] = i;
+    }
+    else
+    {
+        boxes[i] = box;
+        present[i] = true;
+    }
+
+    setBox(c, box);
+    ++nrBoxes;
+
+    //Restore the order by moving the box to its new position.
+    while (i > 0 && boxes[i - 1].lb.x > boxes[i].lb.x)
+    {
+        swapEntries(i - 1, i);
+        --i;
+    }
+
+    while (i + 1 < static_cast<int>(boxes.size()) && boxes[i + 1].lb.x < boxes[i].lb.x)
+    {
+        swapEntries(i, i + 1);
+        ++i;
+    }
+
+    return true;
+}
+
+bool SortedAxis::erase(const int &c)
+{
+    const int i = getIndex(c);
+
+    if (i < 0 || !present[i])
+    {
+        return false;
+    }
+
+    present[i] = false;
+    setBox(c, aabb{vec3(FLT_MAX), vec3(-FLT_MAX)});
+    --nrBoxes;
+
+    return true;
+}
+
+aabb SortedAxis::getNodeBox(const int &c) const noexcept
+{
+    const int i = getIndex(c);
+
+    assert(i >= 0 && present[i]);
+
+    return boxes[i];
+}
+
+void SortedAxis::check() const
+{
+    //Check whether the boxes are sorted and consistent with the contents.
+    int nrPresent = 0;
+    float maxWidth = 0.0f;
+    aabb box = aabb{vec3(FLT_MAX), vec3(-FLT_MAX)};
+
+    for (int i = 0; i < static_cast<int>(boxes.size()); ++i)
+    {
+        assert(contentsToIndex[contents[i]] == i);
+        assert(i == 0 || boxes[i - 1].lb.x <= boxes[i].lb.x);
+        
+        if (present[i])
+        {
+            maxWidth = std::max(maxWidth, boxes[i].ub.x - boxes[i].lb.x);
+            box = cup(box, boxes[i]);
+            ++nrPresent;
+        }
+    }
+
+    assert(nrPresent == nrBoxes);
+    assert(widths.empty() ? maxWidth == 0.0f : widths[1] == maxWidth);
+    assert(bounds.empty() || (bounds[1].lb == box.lb && bounds[1].ub == box.ub));
+}
+
+void SortedAxis::getContentsInRange(const float &xMin, const float &xMax, int &first, int &last) const noexcept
+{
+    //Get the range of boxes that can overlap with the interval [xMin, xMax] along the x-axis.
+    const float maxWidth = (widths.empty() ? 0.0f : widths[1]);
+
+    first = std::lower_bound(boxes.begin(), boxes.end(), xMin - maxWidth, [](const aabb &b, const float &x) {return b.lb.x < x;}) - boxes.begin();
+    last = std::upper_bound(boxes.begin(), boxes.end(), xMax, [](const float &x, const aabb &b) {return x < b.lb.x;}) - boxes.begin();
+}
+
+void SortedAxis::getOverlappingContents(const aabb &b, std::vector<int> &out) const noexcept
+{
+    //Append the contents of all boxes overlapping with the given box.
+    int first, last;
+
+    getContentsInRange(b.lb.x, b.ub.x, first, last);
+
+    for (int i = first; i < last; ++i)
+    {
+        if (present[i] && overlapping(b, boxes[i]))
+        {
+            out.push_back(contents[i]);
+        }
+    }
+}
+
+void SortedAxis::getRayContents(const vec3 &origin, const vec3 &direction, const float &maxDistance, const float &radius, std::vector<int> &out) const noexcept
+{
+    //Append the contents of all boxes, grown by the given radius, hit by the segment origin + t*direction, 0 <= t <= maxDistance.
+    if (bounds.empty()) return;
+
+    //Clip the segment against the bounds of all boxes, grown by the radius, such that unbounded rays only scan the boxes along their finite part.
+    float tMin = 0.0f, tMax = maxDistance;
+
+    if (!aabb{bounds[1].lb - vec3(radius), bounds[1].ub + vec3(radius)}.clipSegment(origin, direction, tMin, tMax)) return;
+
+    const vec3 invDirection = vec3(1.0f)/direction;
+    const float xStart = origin.x + tMin*direction.x;
+    const float xEnd = origin.x + tMax*direction.x;
+    int first, last;
+
+    getContentsInRange(std::min(xStart, xEnd) - radius, std::max(xStart, xEnd) + radius, first, last);
+
+    for (int i = first; i < last; ++i)
+    {
+        if (present[i] && aabb{boxes[i].lb - vec3(radius), boxes[i].ub + vec3(radius)}.isHitByRay(origin, invDirection, maxDistance))
+        {
+            out.push_back(contents[i]);
+        }
+    }
+}
+
@@ -0,0 +1,76 @@
+/*
+Copyright 2024, Bas Fagginger Auer.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <vector>
+
+#include <tiny/math/vec.h>
+#include <tiny/rigid/aabbtree.h>
+
+namespace tiny
+{
+
+namespace aabb
+{
+
+//Boxes sorted along the x-axis, answering each query with a binary search followed by a linear scan.
+//Boxes are kept sorted by their lower x-bound, and moved boxes are restored to order by insertion sort, which is cheap when bodies move coherently.
+//
+//Unlike sweep and prune, overlapping pairs are not maintained between updates: this is a query structure behind the BroadPhase interface.
+//The RigidBodySystem keeps the pairs itself and only queries the boxes of moved bodies, so its cost per update is:
+//  - reinserting a moved box: proportional to the number of boxes it passes along the x-axis,
+//  - querying a box or ray: a binary search plus a scan of all boxes with a lower x-bound in [xMin - w, xMax],
+//    with w the largest present box width and [xMin, xMax] the x-range of the box or of the ray clipped to the bounds of all boxes.
+//Hence, it works best when all boxes are of similar size and rays do not run along the x-axis for long distances.
+class SortedAxis : public BroadPhase
+{
+    public:
+        SortedAxis();
+        ~SortedAxis();
+        
+        void clear();
+        bool insert(const aabb &, const int &);
+        bool erase(const int &);
+        aabb getNodeBox(const int &) const noexcept;
+        void check() const;
+        void getOverlappingContents(const aabb &, std::vector<int> &) const noexcept;
+        void getRayContents(const vec3 &, const vec3 &, const float &, const float &, std::vector<int> &) const noexcept;
+        size_t size() const noexcept;
+        
+    private:
+        int getIndex(const int &) const noexcept;
+        void swapEntries(const int &, const int &);
+        void getContentsInRange(const float &, const float &, int &, int &) const noexcept;
+        void setBox(const int &, const aabb &);
+
+        //Boxes and their contents, sorted by lower x-bound.
+        //Erased boxes keep their position, such that reinserting them only needs to move them over a small distance.
+        std::vector<aabb> boxes;
+        std::vector<int> contents;
+        std::vector<bool> present;
+        //Position in the sorted list for each non-negative contents index, or -1 if it was never inserted.
+        std::vector<int> contentsToIndex;
+        //Binary trees with the x-widths and boxes of present boxes, indexed by contents, at their leaves and their maximum or union at the root.
+        std::vector<float> widths;
+        std::vector<aabb> bounds;
+        int nrBoxes;
+};
+
+} //aabb
+
+} //tiny
+